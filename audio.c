@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2020 Bryan Cain
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "SDL.h"
+#include "audio.h"
+#include "resampler.h"
+#include "ringbuffer.h"
+
+#define FRAME_SIZE (2 * sizeof(int16_t))
+
+// Dynamic rate control: the resampling ratio is nudged by up to this fraction
+// to keep the buffer half full, so audio never drifts away from video timing.
+#define MAX_RATE_DEVIATION 0.005
+
+// maximum number of input frames to resample at once
+#define CHUNK_FRAMES 1024
+
+static struct {
+    SDL_AudioDeviceID device;
+    struct ringbuffer ring;
+    size_t latency_frames;
+    struct resampler *resampler;
+    double ratio; // device rate / core rate
+    int16_t *resampled;
+
+    // samples collected for the current video frame
+    int16_t *batch;
+    size_t batch_frames;
+    size_t batch_capacity;
+
+    bool started; // only count underruns once samples have started arriving
+    atomic_uint_fast64_t underruns;
+    atomic_uint_fast64_t overruns;
+} g_audio = {0};
+
+// Runs on SDL's audio thread.
+static void audio_callback(void *userdata, Uint8 *stream, int len)
+{
+    size_t read = ringbuffer_read(&g_audio.ring, stream, len);
+    if (read < len)
+    {
+        memset(stream + read, 0, len - read);
+        if (g_audio.started)
+            atomic_fetch_add(&g_audio.underruns, 1);
+    }
+    else
+    {
+        g_audio.started = true;
+    }
+}
+
+bool audio_init(int frequency, unsigned latency_ms)
+{
+    SDL_AudioSpec desired;
+    SDL_AudioSpec obtained;
+
+    SDL_zero(desired);
+    SDL_zero(obtained);
+
+    // Have SDL ask for half of the target latency at a time, rounded down to a
+    // power of two.
+    unsigned latency_frames = frequency * latency_ms / 1000;
+    Uint16 period = 256;
+    while (period * 4 <= latency_frames && period < 8192)
+        period <<= 1;
+
+    desired.format = AUDIO_S16;
+    desired.freq   = frequency;
+    desired.channels = 2;
+    desired.samples = period;
+    desired.callback = audio_callback;
+
+    // Let the device run at its native rate; the samples get resampled anyway.
+    g_audio.device = SDL_OpenAudioDevice(NULL, 0, &desired, &obtained, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+    if (!g_audio.device)
+        return false;
+
+    g_audio.ratio = (double) obtained.freq / frequency;
+    g_audio.resampler = resampler_new(g_audio.ratio);
+    g_audio.resampled = malloc(resampler_max_output(CHUNK_FRAMES, g_audio.ratio * (1 + MAX_RATE_DEVIATION)) * FRAME_SIZE);
+
+    // Leave room for twice the target latency before samples are dropped.
+    latency_frames = obtained.freq * latency_ms / 1000;
+    if (latency_frames < obtained.samples * 2)
+        latency_frames = obtained.samples * 2;
+    ringbuffer_init(&g_audio.ring, latency_frames * 2 * FRAME_SIZE);
+    g_audio.latency_frames = latency_frames;
+    g_audio.batch_capacity = 4096;
+    g_audio.batch = malloc(g_audio.batch_capacity * FRAME_SIZE);
+    g_audio.batch_frames = 0;
+    g_audio.started = false;
+    atomic_store(&g_audio.underruns, 0);
+    atomic_store(&g_audio.overruns, 0);
+
+    printf("Audio: %d Hz from %d Hz, %u ms latency, %u frame periods\n",
+           obtained.freq, frequency, latency_ms, obtained.samples);
+    SDL_PauseAudioDevice(g_audio.device, 0);
+    return true;
+}
+
+void audio_deinit(void)
+{
+    if (!g_audio.device)
+        return;
+
+    SDL_CloseAudioDevice(g_audio.device);
+    g_audio.device = 0;
+    ringbuffer_free(&g_audio.ring);
+    resampler_free(g_audio.resampler);
+    g_audio.resampler = NULL;
+    free(g_audio.resampled);
+    g_audio.resampled = NULL;
+    free(g_audio.batch);
+    g_audio.batch = NULL;
+    g_audio.batch_frames = g_audio.batch_capacity = 0;
+}
+
+void audio_pause(bool paused)
+{
+    if (g_audio.device)
+        SDL_PauseAudioDevice(g_audio.device, paused);
+}
+
+size_t audio_write(const int16_t *buf, size_t frames)
+{
+    for (size_t done = 0; done < frames; )
+    {
+        size_t chunk = frames - done;
+        if (chunk > CHUNK_FRAMES)
+            chunk = CHUNK_FRAMES;
+
+        // Produce slightly fewer samples when more than the target latency is
+        // buffered, and slightly more when less is.
+        double fill = (double) audio_buffered_frames() / (2 * g_audio.latency_frames);
+        if (fill > 1.0)
+            fill = 1.0;
+        double ratio = g_audio.ratio * (1.0 + MAX_RATE_DEVIATION * (1.0 - 2.0 * fill));
+
+        size_t out_frames = resampler_process(g_audio.resampler, buf + done * 2, chunk,
+                                              g_audio.resampled, ratio);
+        size_t out_bytes = out_frames * FRAME_SIZE;
+        if (ringbuffer_write(&g_audio.ring, g_audio.resampled, out_bytes) < out_bytes)
+            atomic_fetch_add(&g_audio.overruns, 1);
+        done += chunk;
+    }
+    return frames;
+}
+
+static void grow_batch(size_t frames)
+{
+    while (g_audio.batch_capacity < frames)
+        g_audio.batch_capacity *= 2;
+    g_audio.batch = realloc(g_audio.batch, g_audio.batch_capacity * FRAME_SIZE);
+}
+
+void audio_sample(int16_t left, int16_t right)
+{
+    if (g_audio.batch_frames == g_audio.batch_capacity)
+        grow_batch(g_audio.batch_frames + 1);
+
+    int16_t *dst = &g_audio.batch[g_audio.batch_frames++ * 2];
+    dst[0] = left;
+    dst[1] = right;
+}
+
+void audio_batch(const int16_t *buf, size_t frames)
+{
+    if (g_audio.batch_frames + frames > g_audio.batch_capacity)
+        grow_batch(g_audio.batch_frames + frames);
+
+    memcpy(&g_audio.batch[g_audio.batch_frames * 2], buf, frames * FRAME_SIZE);
+    g_audio.batch_frames += frames;
+}
+
+void audio_flush(void)
+{
+    if (!g_audio.batch_frames)
+        return;
+
+    audio_write(g_audio.batch, g_audio.batch_frames);
+    g_audio.batch_frames = 0;
+}
+
+size_t audio_buffered_frames(void)
+{
+    return ringbuffer_used(&g_audio.ring) / FRAME_SIZE;
+}
+
+void audio_get_stats(uint64_t *underruns, uint64_t *overruns)
+{
+    *underruns = atomic_load(&g_audio.underruns);
+    *overruns = atomic_load(&g_audio.overruns);
+}
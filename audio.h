@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2020 Bryan Cain
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Audio output. The emulator thread writes samples into a lock-free ring
+// buffer, which SDL's audio thread drains from a callback.
+
+// Opens the audio device. latency_ms is the amount of audio to keep buffered.
+// Returns false on failure; call SDL_GetError() for the reason.
+bool audio_init(int frequency, unsigned latency_ms);
+void audio_deinit(void);
+void audio_pause(bool paused);
+
+// Queues interleaved stereo samples at the rate passed to audio_init. They
+// are resampled to the device's rate, adjusted to keep the target latency buffered.
+// Returns the number of frames consumed, which is always all of them.
+size_t audio_write(const int16_t *buf, size_t frames);
+
+// Collect samples for the current video frame, so that they can be written
+// with a single audio_write() call by audio_flush(). This makes each sample
+// from a core that uses the per-sample callback cost little more than a copy.
+void audio_sample(int16_t left, int16_t right);
+void audio_batch(const int16_t *buf, size_t frames);
+void audio_flush(void);
+
+// Returns the number of frames waiting to be played.
+size_t audio_buffered_frames(void);
+
+// Gets the number of times the device ran out of samples, and the number of
+// times samples were dropped because the buffer was full.
+void audio_get_stats(uint64_t *underruns, uint64_t *overruns);
+
+#endif
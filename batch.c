@@ -0,0 +1,437 @@
+/*
+ * Copyright (c) 2020 Bryan Cain
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Batch runner: runs headless on a list of games and movies in parallel, to
+// check many titles at once after a core update. libretro cores keep global
+// state, so every job is a separate headless process; at most --jobs of them
+// run at a time (default: one per CPU). Each process's output comes back over
+// a pipe and is parsed for the results.
+//
+// The job list has one job per line, with tab-separated fields:
+//
+//   game [movie [expected_hash]]
+//
+// Empty lines and lines starting with # are skipped. Without a movie, the game
+// runs for headless's default number of frames. expected_hash is the hash from
+// an earlier run (see --json); if it's given, the job fails if the output differs.
+//
+// With --output-dir, each job's output, hash log and (with --screenshots) last
+// frame are saved there, named after the job's line number and game.
+//
+// usage: batch [--jobs=N] [--headless=PATH] [--headless-args=ARGS] [--timeout=SECONDS]
+//              [--output-dir=DIR] [--screenshots] [--json=FILE] core.so joblist
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <glib.h>
+
+static gint num_workers = 0;
+static gchar *headless_path = NULL;
+static gchar *headless_args = NULL;
+static gchar **extra_args = NULL; // headless_args split up like a shell would
+static gint timeout = 600;
+static gchar *output_dir = NULL;
+static gboolean screenshots = FALSE;
+static gchar *json_path = NULL;
+
+static GOptionEntry entries[] = {
+    { "jobs", 'j', 0, G_OPTION_ARG_INT, &num_workers, "Number of games to run at once (default: one per CPU)", "N" },
+    { "headless", 0, 0, G_OPTION_ARG_FILENAME, &headless_path, "Path to the headless binary (default: next to this one)", "PATH" },
+    { "headless-args", 0, 0, G_OPTION_ARG_STRING, &headless_args, "Extra options to pass to headless", "ARGS" },
+    { "timeout", 't', 0, G_OPTION_ARG_INT, &timeout, "Seconds before a job is killed (default: 600)", "SECONDS" },
+    { "output-dir", 'o', 0, G_OPTION_ARG_FILENAME, &output_dir, "Save each job's output, hash log and screenshot here", "DIR" },
+    { "screenshots", 0, 0, G_OPTION_ARG_NONE, &screenshots, "Save the last frame of each job (needs --output-dir)", NULL },
+    { "json", 0, 0, G_OPTION_ARG_FILENAME, &json_path, "Write the results to FILE as JSON", "FILE" },
+    { NULL }
+};
+
+enum job_status {
+    JOB_OK,
+    JOB_FAILED,   // headless exited with an error
+    JOB_CRASHED,  // killed by a signal
+    JOB_TIMEOUT,
+    JOB_MISMATCH, // the output hash isn't the expected one
+};
+
+static const char *const status_names[] = {"ok", "failed", "crashed", "timeout", "mismatch"};
+
+struct job {
+    int line;
+    char *game;
+    char *movie;         // NULL if none
+    char *expected_hash; // NULL if none
+    char *log_path;      // these three are NULL without --output-dir
+    char *hash_log_path;
+    char *screenshot_path;
+
+    // while running
+    GPid pid;
+    int fds[2]; // stdout and stderr, -1 once closed
+    gint64 start_time;
+    bool killed;
+    GString *output;
+
+    // results
+    enum job_status status;
+    int exit_code;
+    int frames;
+    double wall_time;
+    double fps;
+    char hash[17];
+};
+
+static GPtrArray *jobs;
+
+static bool read_job_list(const char *path)
+{
+    gchar *contents;
+    GError *error = NULL;
+    if (!g_file_get_contents(path, &contents, NULL, &error))
+    {
+        g_printerr("%s\n", error->message);
+        g_clear_error(&error);
+        return false;
+    }
+
+    gchar **lines = g_strsplit(contents, "\n", -1);
+    for (int i = 0; lines[i]; i++)
+    {
+        g_strchomp(lines[i]);
+        if (lines[i][0] == '\0' || lines[i][0] == '#')
+            continue;
+
+        gchar **fields = g_strsplit(lines[i], "\t", 3);
+        struct job *job = calloc(1, sizeof(*job));
+        job->line = i + 1;
+        job->game = strdup(fields[0]);
+        if (fields[1] && fields[1][0])
+            job->movie = strdup(fields[1]);
+        if (fields[1] && fields[2] && fields[2][0])
+            job->expected_hash = strdup(g_strstrip(fields[2]));
+        g_strfreev(fields);
+
+        if (output_dir)
+        {
+            char *basename = g_path_get_basename(job->game);
+            char *name = g_strdup_printf("%04d-%s", job->line, basename);
+            job->log_path = g_strdup_printf("%s/%s.log", output_dir, name);
+            job->hash_log_path = g_strdup_printf("%s/%s.hashes", output_dir, name);
+            if (screenshots)
+                job->screenshot_path = g_strdup_printf("%s/%s.ppm", output_dir, name);
+            g_free(name);
+            g_free(basename);
+        }
+        g_ptr_array_add(jobs, job);
+    }
+
+    g_strfreev(lines);
+    g_free(contents);
+    return true;
+}
+
+static bool start_job(struct job *job, const char *core_path)
+{
+    GPtrArray *args = g_ptr_array_new_with_free_func(g_free);
+    g_ptr_array_add(args, g_strdup(headless_path));
+    g_ptr_array_add(args, g_strdup("--no-audio"));
+
+    // The hash is only printed when there's a movie or a hash log.
+    g_ptr_array_add(args, g_strdup_printf("--hash-log=%s", job->hash_log_path ? job->hash_log_path : "/dev/null"));
+    if (job->movie)
+        g_ptr_array_add(args, g_strdup_printf("--movie=%s", job->movie));
+    if (job->screenshot_path)
+        g_ptr_array_add(args, g_strdup_printf("--screenshot=%s", job->screenshot_path));
+    for (int i = 0; extra_args && extra_args[i]; i++)
+        g_ptr_array_add(args, g_strdup(extra_args[i]));
+    g_ptr_array_add(args, g_strdup(core_path));
+    g_ptr_array_add(args, g_strdup(job->game));
+    g_ptr_array_add(args, NULL);
+
+    GError *error = NULL;
+    bool started = g_spawn_async_with_pipes(NULL, (gchar **) args->pdata, NULL, G_SPAWN_DO_NOT_REAP_CHILD,
+                                            NULL, NULL, &job->pid, NULL, &job->fds[0], &job->fds[1], &error);
+    g_ptr_array_free(args, TRUE);
+    if (!started)
+    {
+        g_printerr("Failed to run %s: %s\n", headless_path, error->message);
+        g_clear_error(&error);
+        return false;
+    }
+
+    job->output = g_string_new(NULL);
+    job->start_time = g_get_monotonic_time();
+    return true;
+}
+
+// Picks the results out of headless's report.
+static void parse_output(struct job *job)
+{
+    gchar **lines = g_strsplit(job->output->str, "\n", -1);
+    for (int i = 0; lines[i]; i++)
+    {
+        sscanf(lines[i], "frames: %d", &job->frames);
+        sscanf(lines[i], "wall time: %lf", &job->wall_time);
+        sscanf(lines[i], "emulated: %lf", &job->fps);
+        sscanf(lines[i], "output hash: %16s", job->hash);
+    }
+    g_strfreev(lines);
+}
+
+static void finish_job(struct job *job, int wait_status, int done)
+{
+    parse_output(job);
+
+    if (job->killed)
+        job->status = JOB_TIMEOUT;
+    else if (WIFSIGNALED(wait_status))
+        job->status = JOB_CRASHED;
+    else if (!WIFEXITED(wait_status) || (job->exit_code = WEXITSTATUS(wait_status)) != 0)
+        job->status = JOB_FAILED;
+    else if (job->expected_hash && strcmp(job->expected_hash, job->hash) != 0)
+        job->status = JOB_MISMATCH;
+    else
+        job->status = JOB_OK;
+
+    if (job->log_path && !g_file_set_contents(job->log_path, job->output->str, job->output->len, NULL))
+        g_printerr("Failed to write %s\n", job->log_path);
+
+    printf("[%d/%u] %-8s %10.1f fps  %s  %s%s%s\n", done, jobs->len, status_names[job->status], job->fps,
+           job->hash[0] ? job->hash : "----------------", job->game,
+           job->movie ? " + " : "", job->movie ? job->movie : "");
+    fflush(stdout);
+
+    g_string_free(job->output, TRUE);
+    job->output = NULL;
+    g_spawn_close_pid(job->pid);
+}
+
+static void write_json_string(FILE *f, const char *s)
+{
+    if (!s)
+    {
+        fprintf(f, "null");
+        return;
+    }
+    fputc('"', f);
+    for (; *s; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            fputc('\\', f);
+        if ((unsigned char) *s >= 0x20)
+            fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+static bool write_json(const char *path, double wall_time)
+{
+    FILE *f = fopen(path, "w");
+    if (!f)
+        return false;
+
+    fprintf(f, "{\n  \"workers\": %d,\n  \"wall_time\": %.3f,\n  \"jobs\": [", num_workers, wall_time);
+    for (guint i = 0; i < jobs->len; i++)
+    {
+        struct job *job = g_ptr_array_index(jobs, i);
+        fprintf(f, "%s\n    {\"line\": %d, \"game\": ", i ? "," : "", job->line);
+        write_json_string(f, job->game);
+        fprintf(f, ", \"movie\": ");
+        write_json_string(f, job->movie);
+        fprintf(f, ", \"status\": \"%s\", \"exit_code\": %d, \"frames\": %d, \"wall_time\": %.3f, \"fps\": %.1f, \"hash\": ",
+                status_names[job->status], job->exit_code, job->frames, job->wall_time, job->fps);
+        write_json_string(f, job->hash[0] ? job->hash : NULL);
+        fprintf(f, ", \"expected_hash\": ");
+        write_json_string(f, job->expected_hash);
+        fprintf(f, ", \"log\": ");
+        write_json_string(f, job->log_path);
+        fprintf(f, ", \"hash_log\": ");
+        write_json_string(f, job->hash_log_path);
+        fprintf(f, ", \"screenshot\": ");
+        write_json_string(f, job->screenshot_path);
+        fprintf(f, "}");
+    }
+    fprintf(f, "\n  ]\n}\n");
+    return fclose(f) == 0;
+}
+
+// Runs every job, keeping up to num_workers of them running at once, and reads
+// their output as it comes so that no process blocks on a full pipe.
+static void run_jobs(const char *core_path)
+{
+    struct job **running = calloc(num_workers, sizeof(*running));
+    struct pollfd *fds = calloc(num_workers * 2, sizeof(*fds));
+    guint next = 0, done = 0;
+    int num_running = 0;
+
+    while (done < jobs->len)
+    {
+        for (int w = 0; w < num_workers && next < jobs->len; w++)
+        {
+            if (running[w])
+                continue;
+            struct job *job = g_ptr_array_index(jobs, next++);
+            if (start_job(job, core_path))
+            {
+                running[w] = job;
+                num_running++;
+            }
+            else
+            {
+                job->status = JOB_FAILED;
+                job->exit_code = -1;
+                done++;
+            }
+        }
+        if (num_running == 0)
+            continue;
+
+        int nfds = 0;
+        for (int w = 0; w < num_workers; w++)
+        {
+            for (int i = 0; running[w] && i < 2; i++)
+            {
+                fds[nfds].fd = running[w]->fds[i];
+                fds[nfds].events = POLLIN;
+                fds[nfds].revents = 0;
+                nfds++;
+            }
+        }
+        // Without any pipes left open, just wait a little for the processes to exit.
+        if (poll(fds, nfds, nfds ? 1000 : 10) < 0 && errno != EINTR)
+        {
+            perror("poll");
+            exit(1);
+        }
+
+        // fds are in the same order as the running jobs' pipes.
+        int f = 0;
+        for (int w = 0; w < num_workers; w++)
+        {
+            struct job *job = running[w];
+            if (!job)
+                continue;
+
+            for (int i = 0; i < 2; i++, f++)
+            {
+                if (job->fds[i] < 0 || !(fds[f].revents & (POLLIN | POLLHUP | POLLERR)))
+                    continue;
+                char buffer[4096];
+                ssize_t n = read(job->fds[i], buffer, sizeof(buffer));
+                if (n > 0)
+                    g_string_append_len(job->output, buffer, n);
+                else if (n == 0 || errno != EINTR)
+                {
+                    close(job->fds[i]);
+                    job->fds[i] = -1;
+                }
+            }
+
+            if (!job->killed && g_get_monotonic_time() - job->start_time > (gint64) timeout * G_USEC_PER_SEC)
+            {
+                kill(job->pid, SIGKILL);
+                job->killed = true;
+            }
+
+            // Closing the pipes doesn't mean the process is gone, so don't block on it.
+            int status;
+            if (job->fds[0] < 0 && job->fds[1] < 0 && waitpid(job->pid, &status, job->killed ? 0 : WNOHANG) == job->pid)
+            {
+                finish_job(job, status, ++done);
+                running[w] = NULL;
+                num_running--;
+            }
+        }
+    }
+
+    free(fds);
+    free(running);
+}
+
+int main(int argc, char **argv)
+{
+    GError *error = NULL;
+    GOptionContext *context = g_option_context_new("CORE JOBLIST - run many games headless in parallel");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        g_printerr("%s\n", error->message);
+        g_clear_error(&error);
+        return 1;
+    }
+    g_option_context_free(context);
+
+    if (argc != 3 || num_workers < 0 || timeout <= 0 || (screenshots && !output_dir))
+    {
+        g_printerr("usage: %s [--jobs=N] [--headless=PATH] [--headless-args=ARGS] [--timeout=SECONDS]\n"
+                   "       [--output-dir=DIR] [--screenshots] [--json=FILE] core.so joblist\n", argv[0]);
+        return 1;
+    }
+    if (headless_args && *headless_args && !g_shell_parse_argv(headless_args, NULL, &extra_args, &error))
+    {
+        g_printerr("Invalid --headless-args: %s\n", error->message);
+        g_clear_error(&error);
+        return 1;
+    }
+    if (num_workers == 0)
+        num_workers = g_get_num_processors();
+    if (!headless_path)
+    {
+        char *dir = g_path_get_dirname(argv[0]);
+        headless_path = g_build_filename(dir, "headless", NULL);
+        g_free(dir);
+    }
+    if (output_dir && g_mkdir_with_parents(output_dir, 0755) != 0)
+    {
+        g_printerr("Failed to create %s\n", output_dir);
+        return 1;
+    }
+
+    jobs = g_ptr_array_new();
+    if (!read_job_list(argv[2]))
+        return 1;
+    if (jobs->len == 0)
+    {
+        g_printerr("No jobs in %s\n", argv[2]);
+        return 1;
+    }
+
+    printf("Running %u jobs, %d at a time\n", jobs->len, num_workers);
+    gint64 start = g_get_monotonic_time();
+    run_jobs(argv[1]);
+    double wall_time = (g_get_monotonic_time() - start) / (double) G_USEC_PER_SEC;
+
+    int counts[G_N_ELEMENTS(status_names)] = {0};
+    for (guint i = 0; i < jobs->len; i++)
+        counts[((struct job *) g_ptr_array_index(jobs, i))->status]++;
+    printf("%u jobs in %.1f s: %d ok, %d failed, %d crashed, %d timed out, %d mismatched\n",
+           jobs->len, wall_time, counts[JOB_OK], counts[JOB_FAILED], counts[JOB_CRASHED],
+           counts[JOB_TIMEOUT], counts[JOB_MISMATCH]);
+
+    if (json_path && !write_json(json_path, wall_time))
+    {
+        g_printerr("Failed to write %s\n", json_path);
+        return 1;
+    }
+    return counts[JOB_OK] == jobs->len ? 0 : 1;
+}
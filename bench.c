@@ -0,0 +1,742 @@
+/*
+ * Copyright (c) 2020 Bryan Cain
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Microbenchmarks for the frontend's hot paths. Each benchmark is run several
+// times and the median is reported, to filter out noise from the rest of the
+// system. With --json, the results are also written out in a form that's easy
+// to compare between builds.
+//
+// The core benchmarks need a core and a game (testcore.so and any file will
+// do). With testcore, they include a run where the resolution changes every
+// frame, checking that nothing is reallocated for it. The texture upload benchmarks use Mesa's llvmpipe through a
+// surfaceless EGL context, so they don't depend on the GPU or a display, and
+// are skipped if that isn't available.
+//
+// With --check-handoff, the triple buffer between the emulator and GUI threads
+// is also put under load and every frame that comes out of it is checked. This
+// recognizes the frames testcore draws, so the core has to be testcore.so.
+//
+// usage: bench [--repetitions=N] [--filter=TEXT] [--json=FILE] [--check-handoff] [core.so game]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <glib.h>
+#include "SDL.h"
+#include "audio.h"
+#include "resampler.h"
+#include "retrocore.h"
+#include "fileio.h"
+#include "sram.h"
+#include "texupload.h"
+#include "util.h"
+#include "config.h"
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+// one video frame's worth of audio at 44.1 kHz and 60 fps
+#define FRAME_SAMPLES 735
+
+// The core renders into its own buffer, which is as wide as its widest mode.
+#define CORE_PITCH (512 * 2)
+#define MAX_WIDTH 512
+#define MAX_HEIGHT 240
+
+// frame sizes the PC Engine uses, by dot clock
+static const struct { unsigned width, height; } resolutions[] = {
+    { 256, 224 }, { 256, 240 }, { 336, 240 }, { 352, 240 }, { 512, 240 },
+};
+
+static gint repetitions = 15;
+static gchar *filter = NULL;
+static gchar *json_path = NULL;
+static gboolean check_handoff = FALSE;
+
+static GOptionEntry entries[] = {
+    { "repetitions", 'r', 0, G_OPTION_ARG_INT, &repetitions, "Times to repeat each benchmark (default: 15)", "N" },
+    { "filter", 0, 0, G_OPTION_ARG_STRING, &filter, "Only run benchmarks whose names contain TEXT", "TEXT" },
+    { "json", 0, 0, G_OPTION_ARG_FILENAME, &json_path, "Write the results to FILE as JSON", "FILE" },
+    { "check-handoff", 0, 0, G_OPTION_ARG_NONE, &check_handoff, "Check the frames passed between threads (needs testcore.so)", NULL },
+    { NULL }
+};
+
+struct result {
+    char *name;
+    int iterations;
+    int items;
+    const char *item_name;
+    double median, mean, stddev, min, max; // seconds per iteration
+};
+
+static GArray *results;
+static FILE *out; // where the results are printed
+
+static int16_t test_audio[FRAME_SAMPLES * 2];
+static uint16_t core_frame[MAX_HEIGHT * CORE_PITCH / 2];
+static uint16_t frame_buffer[MAX_WIDTH * MAX_HEIGHT];
+static unsigned width, height; // the resolution being benchmarked
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Runs fn the given number of times per repetition, and prints the median and
+// spread of the time per iteration.
+static void bench(const char *name, void (*fn)(void), int iterations, int items, const char *item_name)
+{
+    if (filter && !strstr(name, filter))
+        return;
+
+    double *times = malloc(repetitions * sizeof(double));
+    double freq = SDL_GetPerformanceFrequency();
+
+    fn(); // warm up
+    for (int r = 0; r < repetitions; r++)
+    {
+        Uint64 start = SDL_GetPerformanceCounter();
+        for (int i = 0; i < iterations; i++)
+            fn();
+        times[r] = (SDL_GetPerformanceCounter() - start) / freq / iterations;
+    }
+    qsort(times, repetitions, sizeof(double), compare_doubles);
+
+    struct result result = {strdup(name), iterations, items, item_name};
+    result.median = times[repetitions / 2];
+    result.min = times[0];
+    result.max = times[repetitions - 1];
+    for (int r = 0; r < repetitions; r++)
+        result.mean += times[r] / repetitions;
+    for (int r = 0; r < repetitions; r++)
+        result.stddev += (times[r] - result.mean) * (times[r] - result.mean);
+    result.stddev = repetitions > 1 ? sqrt(result.stddev / (repetitions - 1)) : 0;
+    g_array_append_val(results, result);
+
+    fprintf(out, "%-48s %10.3f us  (min %.3f, max %.3f)", name, result.median * 1e6,
+            result.min * 1e6, result.max * 1e6);
+    if (items)
+        fprintf(out, "  %8.2f M%s/s", items / result.median / 1e6, item_name);
+    fprintf(out, "\n");
+    fflush(out);
+    free(times);
+}
+
+static void write_json_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            fputc('\\', f);
+        if ((unsigned char) *s >= 0x20)
+            fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+static bool write_json(const char *path, const char *gl_renderer)
+{
+    FILE *f = fopen(path, "w");
+    if (!f)
+        return false;
+
+    fprintf(f, "{\n  \"repetitions\": %d,\n  \"gl_renderer\": ", repetitions);
+    if (gl_renderer)
+        write_json_string(f, gl_renderer);
+    else
+        fprintf(f, "null");
+    fprintf(f, ",\n  \"benchmarks\": [");
+    for (guint i = 0; i < results->len; i++)
+    {
+        struct result *r = &g_array_index(results, struct result, i);
+        fprintf(f, "%s\n    {\"name\": ", i ? "," : "");
+        write_json_string(f, r->name);
+        fprintf(f, ", \"iterations\": %d, \"median_us\": %.4f, \"mean_us\": %.4f, \"stddev_us\": %.4f, "
+                   "\"min_us\": %.4f, \"max_us\": %.4f",
+                r->iterations, r->median * 1e6, r->mean * 1e6, r->stddev * 1e6, r->min * 1e6, r->max * 1e6);
+        if (r->items)
+            fprintf(f, ", \"items\": %d, \"item\": \"%s\", \"items_per_second\": %.1f",
+                    r->items, r->item_name, r->items / r->median);
+        fprintf(f, "}");
+    }
+    fprintf(f, "\n  ]\n}\n");
+    return fclose(f) == 0;
+}
+
+// Copying a frame out of the core's buffer, as video_refresh does.
+static void video_copy_strided(void)
+{
+    copy_rows(frame_buffer, width * 2, core_frame, CORE_PITCH, width * 2, height);
+}
+
+// ...and when the core's pitch matches the frame width.
+static void video_copy_packed(void)
+{
+    copy_rows(frame_buffer, width * 2, core_frame, width * 2, width * 2, height);
+}
+
+// How audio from the per-sample callback used to be handled: one write each.
+static void audio_per_sample_direct(void)
+{
+    for (int i = 0; i < FRAME_SAMPLES; i++)
+        audio_write(&test_audio[i * 2], 1);
+}
+
+static void audio_per_sample_batched(void)
+{
+    for (int i = 0; i < FRAME_SAMPLES; i++)
+        audio_sample(test_audio[i * 2], test_audio[i * 2 + 1]);
+    audio_flush();
+}
+
+static void audio_batch_callback(void)
+{
+    audio_batch(test_audio, FRAME_SAMPLES);
+    audio_flush();
+}
+
+static struct resampler *resampler;
+static int16_t resampled[FRAME_SAMPLES * 4];
+
+static void resample_frame(void)
+{
+    resampler_process(resampler, test_audio, FRAME_SAMPLES, resampled, 48000.0 / 44100.0);
+}
+
+// A bound key is the slowest case, since it goes through the whole bind list.
+static void key_event_bound(void)
+{
+    handle_key_event(g_config.g_binds[RETRO_DEVICE_ID_JOYPAD_START], true);
+    handle_key_event(g_config.g_binds[RETRO_DEVICE_ID_JOYPAD_START], false);
+}
+
+// PC Engine backup RAM
+#define SRAM_SIZE 2048
+static uint8_t sram[SRAM_SIZE];
+
+// the usual case: the game hasn't written to save RAM this frame
+static void sram_unchanged(void)
+{
+    sram_check(sram);
+}
+
+static char *state_path;
+
+static void run_frame(void)
+{
+    retrocore_run_frame();
+}
+
+// A quick-save and quick-load, including the time for the I/O thread to write
+// and read the file, since the state buffer can't be reused until it's done.
+static void state_round_trip(void)
+{
+    retrocore_save_state(state_path);
+    retrocore_run_frame();
+    fileio_wait();
+    retrocore_load_state(state_path);
+    fileio_wait();
+    retrocore_run_frame();
+}
+
+static void upload_frame(void)
+{
+    texupload_frame(width, height, frame_buffer);
+}
+
+static EGLDisplay egl_display = EGL_NO_DISPLAY;
+static EGLContext egl_context = EGL_NO_CONTEXT;
+
+// Creates a GL 3.2 core context like the one GtkGLArea uses, without a window.
+static bool gl_init(void)
+{
+    // Force llvmpipe, so results are comparable between machines.
+    setenv("LIBGL_ALWAYS_SOFTWARE", "1", 0);
+
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (!get_platform_display)
+        return false;
+    egl_display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (egl_display == EGL_NO_DISPLAY || !eglInitialize(egl_display, NULL, NULL))
+        return false;
+
+    EGLint config_attribs[] = { EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+    EGLint context_attribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 2,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint num_configs = 0;
+    if (!eglBindAPI(EGL_OPENGL_API) ||
+        !eglChooseConfig(egl_display, config_attribs, &config, 1, &num_configs) || num_configs < 1)
+        return false;
+    egl_context = eglCreateContext(egl_display, config, EGL_NO_CONTEXT, context_attribs);
+    return egl_context != EGL_NO_CONTEXT &&
+           eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, egl_context);
+}
+
+static void gl_deinit(void)
+{
+    if (egl_context != EGL_NO_CONTEXT)
+    {
+        eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        eglDestroyContext(egl_display, egl_context);
+    }
+    if (egl_display != EGL_NO_DISPLAY)
+        eglTerminate(egl_display);
+    egl_context = EGL_NO_CONTEXT;
+    egl_display = EGL_NO_DISPLAY;
+}
+
+// Returns the fastest texture upload mode the current context supports.
+static enum texupload_mode gl_best_mode(void)
+{
+    GLint major = 0, minor = 0;
+    glGetIntegerv(GL_MAJOR_VERSION, &major);
+    glGetIntegerv(GL_MINOR_VERSION, &minor);
+    return texupload_detect_mode(major * 10 + minor);
+}
+
+static void bench_video(void)
+{
+    for (int i = 0; i < G_N_ELEMENTS(resolutions); i++)
+    {
+        width = resolutions[i].width;
+        height = resolutions[i].height;
+        char *name = g_strdup_printf("video: row copy %ux%u", width, height);
+        bench(name, video_copy_strided, 1000, width * height, "pixels");
+        g_free(name);
+    }
+    width = 256;
+    height = 240;
+    bench("video: row copy 256x240, packed", video_copy_packed, 1000, width * height, "pixels");
+}
+
+// Returns the name of the GL renderer, or NULL if there's no GL.
+static char *bench_texture_upload(void)
+{
+    if (!gl_init())
+    {
+        printf("texture upload: skipped, no EGL/llvmpipe context\n");
+        gl_deinit();
+        return NULL;
+    }
+    char *gl_renderer = strdup((const char *) glGetString(GL_RENDERER));
+    printf("texture upload: %s\n", gl_renderer);
+
+    enum texupload_mode best = gl_best_mode();
+
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+
+    for (enum texupload_mode mode = TEXUPLOAD_DIRECT; mode <= best; mode++)
+    {
+        texupload_init(mode);
+        texupload_alloc(MAX_WIDTH, MAX_HEIGHT);
+        for (int i = 0; i < G_N_ELEMENTS(resolutions); i++)
+        {
+            width = resolutions[i].width;
+            height = resolutions[i].height;
+            char *name = g_strdup_printf("texture upload: %s %ux%u", texupload_mode_name(mode), width, height);
+            bench(name, upload_frame, 100, width * height, "pixels");
+            g_free(name);
+        }
+        glFinish();
+        texupload_free();
+    }
+
+    glDeleteTextures(1, &texture);
+    gl_deinit();
+    return gl_renderer;
+}
+
+static void bench_sram(void)
+{
+    char *path = g_build_filename(g_get_tmp_dir(), "pce-bench.sav", NULL);
+    sram_open(path, sram, SRAM_SIZE, 1000);
+    bench("sram: per-frame check, unchanged", sram_unchanged, 10000, SRAM_SIZE, "bytes");
+    sram_close();
+    unlink(path);
+    g_free(path);
+}
+
+static int saved_stdout = -1;
+
+// The core and retrocore log every state save and load, which would bury the
+// results, so their output is discarded while a game is loaded.
+static void load_core(const char *core_path, const char *game_path, bool audio)
+{
+    set_default_config();
+    g_config.frame_pacing = false;
+    g_config.audio_enabled = audio;
+    g_config.resume_enabled = false;
+    g_config.rewind_enabled = false;
+
+    fflush(stdout);
+    saved_stdout = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+
+    retrocore_init(core_path);
+    retrocore_load_game(game_path);
+    out = fdopen(dup(saved_stdout), "w");
+}
+
+static void unload_core(void)
+{
+    fclose(out);
+    out = stdout;
+    retrocore_unload_game();
+    retrocore_shutdown();
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+}
+
+static void bench_core(const char *core_path, const char *game_path)
+{
+    load_core(core_path, game_path, false);
+    state_path = g_build_filename(g_get_tmp_dir(), "pce-bench.state", NULL);
+
+    bench("core: run frame", run_frame, 100, 0, NULL);
+    bench("core: save and load state", state_round_trip, 10, 0, NULL);
+
+    unload_core();
+    unlink(state_path);
+    g_free(state_path);
+
+    // The same frames with testcore's audio going to the (dummy) audio device,
+    // through each of the core's ways of passing samples.
+    const char *modes[] = { "batch", "sample" };
+    for (int i = 0; i < G_N_ELEMENTS(modes); i++)
+    {
+        setenv("TESTCORE_AUDIO", modes[i], 1);
+        load_core(core_path, game_path, true);
+        char *name = g_strdup_printf("core: run frame with audio, %s callback", modes[i]);
+        bench(name, run_frame, 100, 0, NULL);
+        g_free(name);
+        unload_core();
+    }
+    unsetenv("TESTCORE_AUDIO");
+}
+
+// The emulator thread runs flat out while the main thread takes frames as fast
+// as it can, like the GUI on a very fast display. Each frame is checked when
+// it's taken and again just before the next one, since the GUI keeps drawing
+// the frame it holds until then.
+#define HANDOFF_FRAMES 20000
+
+static atomic_bool producer_done;
+
+static gpointer produce_frames(gpointer data)
+{
+    for (int i = 0; i < HANDOFF_FRAMES; i++)
+        retrocore_run_frame();
+    atomic_store(&producer_done, true);
+    return NULL;
+}
+
+// Works out which frame testcore drew, modulo 128, from its scrolling gradient:
+// red is (x + frame) & 0x1f and green is (y + frame / 2) & 0x3f. Returns -1 if
+// the rows below the input square don't all agree, as in a torn frame, or a
+// frame whose size doesn't match its pixels.
+static int testcore_frame_number(const struct video_frame *frame)
+{
+    const uint16_t *pixels = frame->data;
+    int number = -1;
+    for (unsigned y = 16; y < frame->height; y++)
+    {
+        unsigned columns[] = { frame->width / 2, frame->width - 1 };
+        for (int i = 0; i < G_N_ELEMENTS(columns); i++)
+        {
+            unsigned x = columns[i];
+            uint16_t pixel = pixels[y * frame->width + x];
+            unsigned red = (pixel >> 11) - x;
+            unsigned half = ((pixel >> 5) & 0x3f) - y;
+            int row_number = ((half & 0x3f) << 1) | (red & 1);
+            if ((row_number & 0x1f) != (red & 0x1f) || (pixel & 0x1f) != (((x ^ y) >> 3) & 0x1f))
+                return -1;
+            if (number >= 0 && row_number != number)
+                return -1;
+            number = row_number;
+        }
+    }
+    return number;
+}
+
+// Makes testcore cycle through the PC Engine's resolutions, changing every
+// interval frames, or stay at the first one if interval is 0.
+static void set_testcore_resolutions(unsigned interval)
+{
+    GString *sizes = g_string_new(NULL);
+    for (int i = 0; i < G_N_ELEMENTS(resolutions); i++)
+        g_string_append_printf(sizes, "%s%ux%u", i ? "," : "", resolutions[i].width, resolutions[i].height);
+    setenv("TESTCORE_RESOLUTIONS", sizes->str, 1);
+    g_string_free(sizes, TRUE);
+
+    char value[16];
+    snprintf(value, sizeof(value), "%u", interval);
+    setenv("TESTCORE_RESIZE_INTERVAL", value, 1);
+}
+
+static bool check_frame_handoff(const char *core_path, const char *game_path, bool software_fb)
+{
+    // Change the resolution every frame, so a frame's size has to travel with it.
+    set_testcore_resolutions(1);
+    setenv("TESTCORE_SOFTWARE_FB", software_fb ? "1" : "0", 1);
+
+    load_core(core_path, game_path, false);
+    atomic_store(&producer_done, false);
+    GThread *producer = g_thread_new("emulator", produce_frames, NULL);
+
+    int taken = 0, bad = 0;
+    int offset = -1; // testcore's frame number minus frame_count, modulo 128
+    int64_t last_frame = -1;
+    struct video_frame *frame = NULL;
+    int number = -1;
+    while (!atomic_load(&producer_done))
+    {
+        if (frame && frame->width && testcore_frame_number(frame) != number)
+        {
+            if (bad++ < 5)
+                fprintf(out, "frame %lld changed while it was held\n", (long long) frame->frame_count);
+        }
+
+        frame = retrocore_get_frame();
+        if (!frame->width || frame->frame_count == last_frame)
+            continue;
+        if (frame->frame_count < last_frame)
+        {
+            if (bad++ < 5)
+                fprintf(out, "frame %lld came after frame %lld\n", (long long) frame->frame_count, (long long) last_frame);
+        }
+        last_frame = frame->frame_count;
+        taken++;
+
+        number = testcore_frame_number(frame);
+        if (offset < 0 && number >= 0)
+            offset = (number - frame->frame_count) & 0x7f;
+
+        // The offset is at most a frame or two, so this gives testcore's frame
+        // number, which tells which size the frame should be.
+        int64_t testcore_frame = frame->frame_count + (offset < 64 ? offset : offset - 128);
+        int expected = testcore_frame >= 0 ? testcore_frame % G_N_ELEMENTS(resolutions) : 0;
+        if (number < 0 || ((number - frame->frame_count) & 0x7f) != offset ||
+            frame->width != resolutions[expected].width || frame->height != resolutions[expected].height)
+        {
+            if (bad++ < 5)
+                fprintf(out, "frame %lld (%ux%u) doesn't match what the core drew\n",
+                        (long long) frame->frame_count, frame->width, frame->height);
+        }
+    }
+    g_thread_join(producer);
+
+    fprintf(out, "%-48s %d frames, %d taken, %d bad\n",
+            software_fb ? "triple buffer: core renders into it" : "triple buffer: copied in",
+            HANDOFF_FRAMES, taken, bad);
+    unload_core();
+    unsetenv("TESTCORE_RESOLUTIONS");
+    unsetenv("TESTCORE_RESIZE_INTERVAL");
+    unsetenv("TESTCORE_SOFTWARE_FB");
+    return bad == 0 && taken > 0;
+}
+
+static void run_and_upload_frame(void)
+{
+    retrocore_run_frame();
+    struct video_frame *frame = retrocore_get_frame();
+    texupload_frame(frame->width, frame->height, frame->data);
+}
+
+// Runs the core and uploads each frame the way the GUI does, into a texture
+// allocated once at the core's maximum size. With testcore switching
+// resolution every frame, this should cost no more than a fixed resolution,
+// and neither the frame buffers nor the texture should ever be reallocated.
+// Returns false if they were, or if the texture doesn't hold the last frame.
+static bool bench_resolution_switching(const char *core_path, const char *game_path, unsigned interval)
+{
+    if (!gl_init())
+    {
+        gl_deinit();
+        return true;
+    }
+    set_testcore_resolutions(interval);
+    load_core(core_path, game_path, false);
+
+    unsigned max_width, max_height;
+    retrocore_get_max_frame_size(&max_width, &max_height);
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+    glPixelStorei(GL_PACK_ALIGNMENT, 2);
+    texupload_init(gl_best_mode());
+    texupload_alloc(max_width, max_height);
+
+    bench(interval ? "core: run and upload frame, new size every frame" : "core: run and upload frame, fixed size",
+          run_and_upload_frame, 100, 0, NULL);
+
+    // Only the three frame buffers should ever come out of the triple buffer.
+    bool ok = true;
+    void *buffers[3] = {0};
+    struct video_frame *frame = NULL;
+    for (int i = 0; i < 60 && ok; i++)
+    {
+        run_and_upload_frame();
+        frame = retrocore_get_frame();
+        int j = 0;
+        while (j < 3 && buffers[j] && buffers[j] != frame->data)
+            j++;
+        if (j == 3)
+        {
+            fprintf(out, "frame buffer %p was allocated while running\n", frame->data);
+            ok = false;
+        }
+        else
+            buffers[j] = frame->data;
+    }
+
+    GLint texture_width = 0, texture_height = 0;
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &texture_width);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &texture_height);
+    if (texture_width != max_width || texture_height != max_height)
+    {
+        fprintf(out, "texture is %dx%d instead of %ux%u\n", texture_width, texture_height, max_width, max_height);
+        ok = false;
+    }
+
+    uint16_t *pixels = malloc(max_width * max_height * 2);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGB, GL_UNSIGNED_SHORT_5_6_5, pixels);
+    for (unsigned y = 0; y < frame->height && ok; y++)
+    {
+        if (memcmp(pixels + y * max_width, (uint16_t *) frame->data + y * frame->width, frame->width * 2))
+        {
+            fprintf(out, "row %u of the %ux%u frame didn't reach the texture\n", y, frame->width, frame->height);
+            ok = false;
+        }
+    }
+    free(pixels);
+
+    texupload_free();
+    glDeleteTextures(1, &texture);
+    unload_core();
+    unsetenv("TESTCORE_RESOLUTIONS");
+    unsetenv("TESTCORE_RESIZE_INTERVAL");
+    gl_deinit();
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    GError *error = NULL;
+    GOptionContext *context = g_option_context_new("[CORE GAME] - benchmark the frontend's hot paths");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        g_printerr("%s\n", error->message);
+        g_clear_error(&error);
+        return 1;
+    }
+    g_option_context_free(context);
+    if (argc != 1 && argc != 3)
+    {
+        g_printerr("usage: %s [--repetitions=N] [--filter=TEXT] [--json=FILE] [--check-handoff] [core.so game]\n", argv[0]);
+        return 1;
+    }
+    if (repetitions < 1)
+        repetitions = 1;
+
+    results = g_array_new(FALSE, FALSE, sizeof(struct result));
+    out = stdout;
+    set_default_config();
+
+    for (int i = 0; i < FRAME_SAMPLES; i++)
+        test_audio[i * 2] = test_audio[i * 2 + 1] = 10000 * sin(i * 0.1);
+    for (int i = 0; i < G_N_ELEMENTS(core_frame); i++)
+        core_frame[i] = i * 2654435761u >> 16;
+
+    // The samples have to go somewhere, but there's no need to hear them.
+    setenv("SDL_AUDIODRIVER", "dummy", 0);
+    if (SDL_Init(SDL_INIT_AUDIO) < 0 || !audio_init(44100, 64))
+    {
+        g_printerr("Failed to initialize audio: %s\n", SDL_GetError());
+        return 1;
+    }
+
+    bench_video();
+
+    bench("audio: per-sample, direct write", audio_per_sample_direct, 100, FRAME_SAMPLES, "samples");
+    bench("audio: per-sample, batched", audio_per_sample_batched, 100, FRAME_SAMPLES, "samples");
+    bench("audio: batch callback", audio_batch_callback, 100, FRAME_SAMPLES, "samples");
+
+    resampler = resampler_new(48000.0 / 44100.0);
+    bench("resampler: 44100 -> 48000 Hz", resample_frame, 100, FRAME_SAMPLES, "samples");
+    resampler_free(resampler);
+
+    audio_deinit();
+
+    bench("input: key press and release", key_event_bound, 10000, 2, "events");
+    bench_sram();
+
+    char *gl_renderer = bench_texture_upload();
+
+    bool ok = true;
+    if (argc == 3)
+    {
+        bench_core(argv[1], argv[2]);
+        ok &= bench_resolution_switching(argv[1], argv[2], 0);
+        ok &= bench_resolution_switching(argv[1], argv[2], 1);
+    }
+
+    if (check_handoff && argc == 3)
+    {
+        ok &= check_frame_handoff(argv[1], argv[2], false);
+        ok &= check_frame_handoff(argv[1], argv[2], true);
+    }
+    else if (check_handoff)
+    {
+        g_printerr("--check-handoff needs a core and a game\n");
+        ok = false;
+    }
+
+    SDL_Quit();
+
+    if (json_path && !write_json(json_path, gl_renderer))
+    {
+        g_printerr("Failed to write %s\n", json_path);
+        return 1;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) 2020 Bryan Cain
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <glib.h>
+#include "bootcache.h"
+#include "fileio.h"
+
+#define CACHE_MAGIC "PCEBOOT1"
+#define HASH_CHUNK_SIZE (1 << 20)
+
+struct cache_header {
+    char magic[8];
+    uint64_t frame;
+    uint64_t state_size;
+};
+
+// Shared between the emulator thread and the lookup thread; freed by whichever
+// drops the last reference, since the game can be closed before hashing is done.
+struct lookup {
+    atomic_int refs;
+    atomic_bool cancelled;
+    atomic_bool done;
+    char *game_path;
+    char *bios_path;
+
+    // Set by the lookup thread before done; only used by the emulator thread after.
+    char *cache_path; // NULL if the files couldn't be hashed
+    char *data;       // the cache file, starting with a struct cache_header
+    size_t size;
+};
+
+static struct lookup *g_lookup = NULL;
+
+static void lookup_unref(struct lookup *lookup)
+{
+    if (atomic_fetch_sub(&lookup->refs, 1) != 1)
+        return;
+
+    free(lookup->game_path);
+    free(lookup->bios_path);
+    g_free(lookup->cache_path);
+    g_free(lookup->data);
+    free(lookup);
+}
+
+static bool hash_file(GChecksum *checksum, const char *path, struct lookup *lookup)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return false;
+
+    guchar *buffer = malloc(HASH_CHUNK_SIZE);
+    uint64_t total = 0;
+    size_t n;
+    while ((n = fread(buffer, 1, HASH_CHUNK_SIZE, fp)) > 0 && !atomic_load(&lookup->cancelled))
+    {
+        g_checksum_update(checksum, buffer, n);
+        total += n;
+    }
+
+    // Keep the boundaries between files in the hash.
+    g_checksum_update(checksum, (const guchar *) &total, sizeof(total));
+
+    free(buffer);
+    fclose(fp);
+    return true;
+}
+
+// Hashes the tracks listed in a .cue sheet, which are relative to the sheet's directory.
+static bool hash_cue_tracks(GChecksum *checksum, const char *cue_path, struct lookup *lookup)
+{
+    gchar *contents;
+    if (!g_file_get_contents(cue_path, &contents, NULL, NULL))
+        return false;
+
+    gchar *dir = g_path_get_dirname(cue_path);
+    gchar **lines = g_strsplit(contents, "\n", -1);
+    bool success = true;
+
+    for (int i = 0; lines[i] && success; i++)
+    {
+        gchar *line = g_strstrip(lines[i]);
+        if (g_ascii_strncasecmp(line, "FILE ", 5) != 0)
+            continue;
+
+        // FILE "name.bin" BINARY, or FILE name.bin BINARY
+        gchar *name = g_strstrip(line + 5);
+        gchar *end;
+        if (name[0] == '"')
+            end = strchr(++name, '"');
+        else
+            end = strchr(name, ' ');
+        if (end)
+            *end = '\0';
+
+        gchar *track_path = g_build_filename(dir, name, NULL);
+        success = hash_file(checksum, track_path, lookup);
+        g_free(track_path);
+    }
+
+    g_strfreev(lines);
+    g_free(dir);
+    g_free(contents);
+    return success;
+}
+
+static gpointer lookup_thread(gpointer data)
+{
+    struct lookup *lookup = data;
+    GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA1);
+
+    bool hashed = hash_file(checksum, lookup->game_path, lookup);
+    if (hashed && g_str_has_suffix(lookup->game_path, ".cue"))
+        hashed = hash_cue_tracks(checksum, lookup->game_path, lookup);
+
+    // HuCard games don't need the BIOS, so it's fine if it's missing.
+    hash_file(checksum, lookup->bios_path, lookup);
+
+    if (hashed && !atomic_load(&lookup->cancelled))
+    {
+        gchar *dir = g_build_filename(g_get_user_cache_dir(), "pce-boot-states", NULL);
+        gchar *name = g_strconcat(g_checksum_get_string(checksum), ".state", NULL);
+        lookup->cache_path = g_build_filename(dir, name, NULL);
+        g_mkdir_with_parents(dir, 0755);
+        g_free(name);
+        g_free(dir);
+
+        gchar *contents;
+        gsize size;
+        if (g_file_get_contents(lookup->cache_path, &contents, &size, NULL))
+        {
+            const struct cache_header *header = (const struct cache_header *) contents;
+            if (size >= sizeof(*header) && memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) == 0 &&
+                header->state_size == size - sizeof(*header))
+            {
+                lookup->data = contents;
+                lookup->size = size;
+            }
+            else
+            {
+                printf("Ignoring invalid boot cache entry %s\n", lookup->cache_path);
+                g_free(contents);
+            }
+        }
+    }
+
+    g_checksum_free(checksum);
+    atomic_store(&lookup->done, true);
+    lookup_unref(lookup);
+    return NULL;
+}
+
+void bootcache_open(const char *game_path, const char *bios_path)
+{
+    bootcache_close();
+
+    struct lookup *lookup = calloc(1, sizeof(*lookup));
+    atomic_init(&lookup->refs, 2);
+    lookup->game_path = strdup(game_path);
+    lookup->bios_path = strdup(bios_path);
+    g_lookup = lookup;
+
+    g_thread_unref(g_thread_new("boot cache lookup", lookup_thread, lookup));
+}
+
+bool bootcache_ready(void)
+{
+    return g_lookup && atomic_load(&g_lookup->done);
+}
+
+bool bootcache_get(const void **state, size_t *size, int64_t *frame)
+{
+    if (!bootcache_ready() || !g_lookup->data)
+        return false;
+
+    const struct cache_header *header = (const struct cache_header *) g_lookup->data;
+    *state = header + 1;
+    *size = header->state_size;
+    *frame = header->frame;
+    return true;
+}
+
+// Called on the I/O thread.
+static void entry_written(const char *path, bool success, void *data, size_t size, void *user_data)
+{
+    printf("%s boot cache entry %s\n", success ? "Saved" : "Failed to save", path);
+    g_free(data);
+}
+
+bool bootcache_store(const void *state, size_t size, int64_t frame)
+{
+    if (!bootcache_ready() || !g_lookup->cache_path)
+        return false;
+
+    struct cache_header header = { .frame = frame, .state_size = size };
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+
+    char *entry = g_malloc(sizeof(header) + size);
+    memcpy(entry, &header, sizeof(header));
+    memcpy(entry + sizeof(header), state, size);
+
+    // Keep a copy for this session, since resets skip the boot sequence too.
+    g_free(g_lookup->data);
+    g_lookup->size = sizeof(header) + size;
+    g_lookup->data = g_malloc(g_lookup->size);
+    memcpy(g_lookup->data, entry, g_lookup->size);
+
+    fileio_write(g_lookup->cache_path, entry, g_lookup->size, entry_written, NULL);
+    return true;
+}
+
+void bootcache_close(void)
+{
+    if (!g_lookup)
+        return;
+
+    atomic_store(&g_lookup->cancelled, true);
+    lookup_unref(g_lookup);
+    g_lookup = NULL;
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2020 Bryan Cain
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BOOTCACHE_H
+#define BOOTCACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Caches a state captured once a game has finished booting, so that later
+// launches can skip the System Card boot sequence. Entries are keyed by a hash
+// of the game's files and the BIOS, so changing either invalidates them.
+
+// Starts hashing the game's files (including the tracks of a .cue sheet) and the
+// BIOS, and looking up the cache entry for them, on a background thread.
+void bootcache_open(const char *game_path, const char *bios_path);
+
+// Returns true once the lookup started by bootcache_open is done.
+bool bootcache_ready(void);
+
+// Gets the cached state and the frame it was captured on. Returns false if
+// there's no entry for this game, or the lookup isn't done yet.
+bool bootcache_get(const void **state, size_t *size, int64_t *frame);
+
+// Makes state the cache entry for the current game, and writes it out in the
+// background. Returns false if the lookup isn't done or the files couldn't be hashed.
+bool bootcache_store(const void *state, size_t size, int64_t frame);
+
+void bootcache_close(void);
+
+#endif
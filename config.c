@@ -27,6 +27,28 @@ struct config g_config;
 void set_default_config(void)
 {
     g_config.video_scale = 2;
+    g_config.video_enabled = true;
+    g_config.audio_enabled = true;
+    g_config.frame_pacing = true;
+    g_config.rewind_enabled = true;
+    g_config.rewind_key = GDK_KEY_Delete;
+    g_config.rewind_interval = 2;
+    g_config.rewind_buffer_mb = 32;
+    g_config.runahead_frames = 0;
+    g_config.audio_latency_ms = 64;
+    g_config.frameskip_enabled = true;
+    g_config.frameskip_max = 4;
+    g_config.fast_forward_key = GDK_KEY_Tab;
+    g_config.fast_forward_toggle = false;
+    g_config.fast_forward_speed = 0;
+    g_config.auto_turbo = false;
+    g_config.resume_enabled = true;
+    g_config.boot_cache_enabled = false;
+    g_config.boot_cache_frame = 0;
+    g_config.boot_cache_key = GDK_KEY_F9;
+    g_config.vfs_preload = false;
+    g_config.sram_flush_delay_ms = 1000;
+    g_config.movie_keyframe_interval = 600;
     memset(g_config.g_binds, 0, sizeof(g_config.g_binds));
     g_config.g_binds[RETRO_DEVICE_ID_JOYPAD_A] = GDK_KEY_x;
     g_config.g_binds[RETRO_DEVICE_ID_JOYPAD_B] = GDK_KEY_z;
@@ -23,6 +23,54 @@
 struct config {
     unsigned int video_scale; // valid values: 1, 2, 3, or 4
     unsigned int g_binds[RETRO_DEVICE_ID_JOYPAD_R3 + 1];
+
+    // These are only turned off for headless runs (benchmarks), where there is
+    // no GUI to display frames or pace the emulator thread.
+    bool video_enabled; // pass the core's frames on to the GUI through the triple buffer
+    bool audio_enabled; // open an audio device and queue the core's samples
+    bool frame_pacing;  // hold each frame until its presentation time instead of running flat out
+
+    // Holding rewind_key steps back through states captured every rewind_interval frames.
+    bool rewind_enabled;
+    unsigned int rewind_key;
+    unsigned int rewind_interval;
+    unsigned int rewind_buffer_mb; // memory limit for the compressed states
+
+    // Number of frames to run ahead of the displayed frame to cut input lag (0 = off).
+    unsigned int runahead_frames;
+
+    unsigned int audio_latency_ms; // how much audio to keep buffered
+
+    // Skip rendering frames when the host can't keep up, at most frameskip_max in a row.
+    bool frameskip_enabled;
+    unsigned int frameskip_max;
+
+    // Fast-forward while fast_forward_key is held, or toggle it with each press.
+    unsigned int fast_forward_key;
+    bool fast_forward_toggle;
+    double fast_forward_speed; // multiple of normal speed; 0 = as fast as possible
+
+    // Fast-forward automatically through loading screens.
+    bool auto_turbo;
+
+    // Save the state when a game is closed, and offer to resume from it next time.
+    bool resume_enabled;
+
+    // Cache the state once a game has booted, and skip to it on later launches. The
+    // state is captured on boot_cache_frame (0 = never), or when boot_cache_key is pressed.
+    bool boot_cache_enabled;
+    unsigned int boot_cache_frame;
+    unsigned int boot_cache_key;
+
+    // Read disc images into memory in full when the core opens them, instead of
+    // mapping them and reading ahead.
+    bool vfs_preload;
+
+    // How long save RAM has to stay unchanged before it's written to the .sav file.
+    unsigned int sram_flush_delay_ms;
+
+    // Frames between the full states saved in input movies, for seeking.
+    unsigned int movie_keyframe_interval;
 };
 
 extern struct config g_config;
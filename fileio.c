@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2020 Bryan Cain
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <glib.h>
+#include "fileio.h"
+
+enum job_type {
+    JOB_WRITE,
+    JOB_READ,
+    JOB_WAIT,
+    JOB_QUIT,
+};
+
+struct job {
+    enum job_type type;
+    char *path;
+    const void *data;
+    size_t size;
+    fileio_callback callback;
+    void *user_data;
+};
+
+static GAsyncQueue *g_jobs = NULL;
+static GThread *g_io_thread = NULL;
+
+static bool write_file_atomic(const char *path, const void *data, size_t size)
+{
+    char *tmp_path = g_strdup_printf("%s.tmp", path);
+    bool success = false;
+
+    FILE *fp = fopen(tmp_path, "wb");
+    if (fp)
+    {
+        success = fwrite(data, 1, size, fp) == size && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+        success = (fclose(fp) == 0) && success;
+        success = success && rename(tmp_path, path) == 0;
+        if (!success)
+            remove(tmp_path);
+    }
+
+    g_free(tmp_path);
+    return success;
+}
+
+static gpointer io_thread(gpointer unused)
+{
+    while (true)
+    {
+        struct job *job = g_async_queue_pop(g_jobs);
+        if (job->type == JOB_QUIT)
+        {
+            free(job);
+            break;
+        }
+
+        if (job->type == JOB_WAIT)
+        {
+            // user_data is the queue the waiting thread is blocked on.
+            g_async_queue_push(job->user_data, job);
+            continue;
+        }
+        else if (job->type == JOB_WRITE)
+        {
+            bool success = write_file_atomic(job->path, job->data, job->size);
+            if (job->callback)
+                job->callback(job->path, success, (void *) job->data, job->size, job->user_data);
+        }
+        else
+        {
+            gchar *contents = NULL;
+            gsize length = 0;
+            bool success = g_file_get_contents(job->path, &contents, &length, NULL);
+            if (job->callback)
+                job->callback(job->path, success, contents, length, job->user_data);
+            else
+                g_free(contents);
+        }
+
+        free(job->path);
+        free(job);
+    }
+
+    return NULL;
+}
+
+void fileio_init(void)
+{
+    if (g_io_thread)
+        return;
+
+    if (!g_jobs)
+        g_jobs = g_async_queue_new();
+    g_io_thread = g_thread_new("file I/O", io_thread, NULL);
+}
+
+void fileio_wait(void)
+{
+    if (!g_io_thread)
+        return;
+
+    GAsyncQueue *done = g_async_queue_new();
+    struct job *job = calloc(1, sizeof(*job));
+    job->type = JOB_WAIT;
+    job->user_data = done;
+    g_async_queue_push(g_jobs, job);
+    free(g_async_queue_pop(done));
+    g_async_queue_unref(done);
+}
+
+void fileio_shutdown(void)
+{
+    if (!g_io_thread)
+        return;
+
+    struct job *job = calloc(1, sizeof(*job));
+    job->type = JOB_QUIT;
+    g_async_queue_push(g_jobs, job);
+    g_thread_join(g_io_thread);
+    g_io_thread = NULL;
+}
+
+static void queue_job(enum job_type type, const char *path, const void *data, size_t size,
+                      fileio_callback callback, void *user_data)
+{
+    struct job *job = malloc(sizeof(*job));
+    job->type = type;
+    job->path = strdup(path);
+    job->data = data;
+    job->size = size;
+    job->callback = callback;
+    job->user_data = user_data;
+    g_async_queue_push(g_jobs, job);
+}
+
+void fileio_write(const char *path, const void *data, size_t size, fileio_callback callback, void *user_data)
+{
+    queue_job(JOB_WRITE, path, data, size, callback, user_data);
+}
+
+void fileio_read(const char *path, fileio_callback callback, void *user_data)
+{
+    queue_job(JOB_READ, path, NULL, 0, callback, user_data);
+}
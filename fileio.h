@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2020 Bryan Cain
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FILEIO_H
+#define FILEIO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Background thread for reading and writing whole files, so that a slow disk
+// never holds up the emulator thread. Jobs are done in the order they're queued.
+
+// Called on the I/O thread when a job is done. For writes, data is the buffer
+// that was passed in, which the caller owns again. For reads, data is the file's
+// contents (NULL on failure), which the callback must free with g_free().
+typedef void (*fileio_callback)(const char *path, bool success, void *data, size_t size, void *user_data);
+
+// Starts the I/O thread if it isn't running yet.
+void fileio_init(void);
+
+// Waits until all jobs queued so far are done.
+void fileio_wait(void);
+
+// Finishes all queued jobs and stops the I/O thread.
+void fileio_shutdown(void);
+
+// Writes data to a temporary file, then renames it over path, so that path
+// always contains either the old or the new data in full. The data must stay
+// valid until the callback is called.
+void fileio_write(const char *path, const void *data, size_t size, fileio_callback callback, void *user_data);
+
+// Reads the entire file at path.
+void fileio_read(const char *path, fileio_callback callback, void *user_data);
+
+#endif
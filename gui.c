@@ -18,10 +18,12 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 #include <gtk/gtk.h>
 #include "util.h"
 #include "retrocore.h"
 #include "config.h"
+#include "texupload.h"
 
 #define GL_GLEXT_PROTOTYPES
 #include <GL/gl.h>
@@ -31,14 +33,21 @@ static GtkBuilder *builder = NULL;
 
 static GLuint shader_program = 0;
 static bool texture_inited = 0;
+// The texture is allocated at the core's maximum frame size, so that changes
+// in resolution don't reallocate it. Frames go in the top left corner.
 static GLsizei texture_w = 0, texture_h = 0;
 
+// the frame currently in the texture, to avoid uploading it again
+static const struct video_frame *uploaded_frame = NULL;
+
+static struct {
+    gint64 total_time;
+    int count;
+} g_upload_stats = {0};
+
 static GThread *emu_thread = NULL;
 static char *rom_path = NULL;
 
-GMutex g_frame_lock = {0};
-GCond g_ready_cond = {0};
-
 int64_t last_frame_count = -1;
 static unsigned int state_slot = 0;
 
@@ -46,6 +55,27 @@ static bool g_fullscreen = false;
 static gint64 g_last_mouse_movement = 0;
 static GdkCursor *g_blank_cursor = NULL;
 
+// Status messages temporarily replace the window title.
+static char *g_window_title = NULL;
+static unsigned g_status_message_id = 0;
+
+
+static void upload_frame(const struct video_frame *frame)
+{
+    gint64 start = g_get_monotonic_time();
+    texupload_frame(frame->width, frame->height, frame->data);
+    glUniform2f(glGetUniformLocation(shader_program, "tex_dims"), frame->width, frame->height);
+    uploaded_frame = frame;
+
+    g_upload_stats.total_time += g_get_monotonic_time() - start;
+    if (++g_upload_stats.count == 600)
+    {
+        printf("texture upload: %.3f ms per frame\n",
+               g_upload_stats.total_time / 1000.0 / g_upload_stats.count);
+        g_upload_stats.total_time = 0;
+        g_upload_stats.count = 0;
+    }
+}
 
 static gboolean render(GtkGLArea *area, GdkGLContext *context)
 {
@@ -75,39 +105,25 @@ static gboolean render(GtkGLArea *area, GdkGLContext *context)
     GLint aspect_scale_loc = glGetUniformLocation(shader_program, "aspect_scale");
     glUniform2f(aspect_scale_loc, rx, ry);
 
-    g_mutex_lock(&g_frame_lock);
-    struct video_frame *frame;
-    double now = retrocore_time();
-    if (now >= g_frames[g_next_frame].presentation_time &&
-        (g_frames[g_next_frame].frame_count == last_frame_count + 1 ||
-         now - g_frames[g_next_frame].presentation_time >= target_frame_time))
-    {
-        frame = &g_frames[g_next_frame];
-        //printf("advancing to frame %li (%i)\n", frame->frame_count, g_next_frame);
-        g_cond_signal(&g_ready_cond);
-        //printf("signalled at %.3f s (%.3f s after frame %li pres time of %.3f s)\n", retrocore_time(), retrocore_time() - frame->presentation_time, frame->frame_count, frame->presentation_time);
-    }
-    else
-    {
-        frame = &g_frames[!g_next_frame];
-        //printf("staying on frame %li (%i)\n", frame->frame_count, !g_next_frame);
-        g_assert(retrocore_time() >= frame->presentation_time);
-    }
+    // The emulator thread doesn't hand over a frame until it's time to display it.
+    struct video_frame *frame = retrocore_get_frame();
 
-    if (frame->data != NULL)
+    if (frame->width != 0)
     {
-        if (!texture_inited || texture_w != frame->width || texture_h != frame->height)
+        unsigned max_width, max_height;
+        retrocore_get_max_frame_size(&max_width, &max_height);
+        if (!texture_inited || texture_w != max_width || texture_h != max_height)
         {
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, frame->width, frame->height, 0,
-                         GL_RGB, GL_UNSIGNED_SHORT_5_6_5, NULL);
-            glUniform2f(glGetUniformLocation(shader_program, "tex_dims"), frame->width, frame->height);
+            texupload_alloc(max_width, max_height);
+            glUniform2f(glGetUniformLocation(shader_program, "tex_size"), max_width, max_height);
             texture_inited = true;
-            texture_w = frame->width;
-            texture_h = frame->height;
+            texture_w = max_width;
+            texture_h = max_height;
+            uploaded_frame = NULL;
         }
 
-        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, frame->width, frame->height,
-            GL_RGB, GL_UNSIGNED_SHORT_5_6_5, frame->data);
+        if (frame != uploaded_frame)
+            upload_frame(frame);
         float scaleFactor = MAX((float)allocatedWidth * rx / frame->width,
                                 (float)allocatedHeight * ry / frame->height);
         glUniform1f(glGetUniformLocation(shader_program, "scale_factor"), scaleFactor);
@@ -131,8 +147,6 @@ static gboolean render(GtkGLArea *area, GdkGLContext *context)
     }
 #endif
 
-    g_mutex_unlock(&g_frame_lock);
-
     return TRUE;
 }
 
@@ -193,13 +207,15 @@ static void on_realize_gl_area(GtkGLArea *area)
     "out vec4 frag_color;\n"
     "uniform sampler2D texture;\n"
     "uniform vec2 tex_dims;\n"
+    "uniform vec2 tex_size;\n"
 	"uniform float scale_factor;\n"
     "void main() {\n"
     "   vec2 texel = tex_coord * tex_dims;\n"
     "   float region_range = 0.5 - 0.5 / scale_factor;\n"
     "   vec2 distFromCenter = fract(texel) - 0.5;\n"
     "   vec2 f = (distFromCenter - clamp(distFromCenter, -region_range, region_range)) * scale_factor + 0.5;\n"
-    "   frag_color = texture2D(texture, (floor(texel) + f) / tex_dims);\n"
+    "   vec2 coord = clamp(floor(texel) + f, vec2(0.5), tex_dims - 0.5);\n"
+    "   frag_color = texture2D(texture, coord / tex_size);\n"
     "}\n";
 
     GLuint vs = glCreateShader(GL_VERTEX_SHADER);
@@ -219,6 +235,12 @@ static void on_realize_gl_area(GtkGLArea *area)
     glBindVertexArray(vao);
 
     glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+
+    int major, minor;
+    gdk_gl_context_get_version(gtk_gl_area_get_context(area), &major, &minor);
+    enum texupload_mode mode = texupload_detect_mode(major * 10 + minor);
+    texupload_init(mode);
+    printf("Texture uploads: %s\n", texupload_mode_name(mode));
 }
 
 // callback that makes the GL area redraw on every frame
@@ -254,9 +276,15 @@ static gboolean tick_cb(GtkWidget *gl_area_w, GdkFrameClock *frame_clock, gpoint
 
 static gboolean handle_key_press(GtkWidget *widget, GdkEventKey *event)
 {
-    gtk_window_activate_key(GTK_WINDOW(widget), event);
+    if (gtk_window_activate_key(GTK_WINDOW(widget), event))
+        return TRUE;
     //gtk_window_propagate_key_event(GTK_WINDOW(widget), event);
 
+    // Keys pressed with Ctrl, Alt etc. are shortcuts, not game or hotkey input.
+    // Releases still go through so that a key held before the modifier isn't stuck.
+    if (event->state & gtk_accelerator_get_default_mod_mask() & ~GDK_SHIFT_MASK)
+        return TRUE;
+
     handle_key_event(event->keyval, true);
     return TRUE;
 }
@@ -312,27 +340,44 @@ static void close_game()
     if (!emu_thread)
         return;
 
-    g_mutex_lock(&g_frame_lock);
     retrocore_close_game();
-    g_cond_signal(&g_ready_cond);
-    g_mutex_unlock(&g_frame_lock);
     g_thread_join(emu_thread);
     emu_thread = NULL;
     free(rom_path);
     rom_path = NULL;
+    uploaded_frame = NULL;
 
     // the GL area needs to redraw itself one last time, to clear everything
     GtkWidget *gl_area = GTK_WIDGET(gtk_builder_get_object(builder, "glArea"));
     gtk_widget_queue_draw(gl_area);
 }
 
-static void load_game(const char *path)
+// Asks whether to continue from where the game was last closed.
+static bool ask_to_resume(void)
+{
+    GtkWindow *parent_window = GTK_WINDOW(gtk_builder_get_object(builder, "mainWindow"));
+    GtkWidget *dialog = gtk_message_dialog_new(parent_window,
+                                               GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
+                                               GTK_MESSAGE_QUESTION,
+                                               GTK_BUTTONS_YES_NO,
+                                               "Resume where you left off?");
+    gtk_message_dialog_format_secondary_text(GTK_MESSAGE_DIALOG(dialog),
+                                             "The game was saved automatically when it was last closed.");
+
+    gint res = gtk_dialog_run(GTK_DIALOG(dialog));
+    gtk_widget_destroy(dialog);
+    return res == GTK_RESPONSE_YES;
+}
+
+static void load_game(const char *path, bool offer_resume)
 {
     if (emu_thread)
         close_game();
 
     retrocore_init("./mednafen_pce_libretro.so");
     retrocore_load_game(path);
+    if (offer_resume && g_config.resume_enabled && retrocore_has_resume_state() && ask_to_resume())
+        retrocore_resume();
     emu_thread = g_thread_new("emulator", retrocore_run_game, NULL);
     rom_path = strdup(path);
 }
@@ -389,7 +434,7 @@ static void on_open_button_activate(GtkMenuItem *open_button, gpointer data)
         filename = gtk_file_chooser_get_filename(chooser);
 
         printf("Open ROM: %s\n", filename);
-        load_game(filename);
+        load_game(filename, true);
 
         g_free(filename);
     }
@@ -490,6 +535,121 @@ static void on_quick_save_activate(GtkMenuItem *item, gpointer unused)
     free(save_path);
 }
 
+// Shows a message in the title bar for a few seconds.
+static gboolean restore_window_title(gpointer id)
+{
+    if (GPOINTER_TO_UINT(id) == g_status_message_id)
+    {
+        GtkWindow *window = GTK_WINDOW(gtk_builder_get_object(builder, "mainWindow"));
+        gtk_window_set_title(window, g_window_title ? g_window_title : "");
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean show_status_message(gpointer message)
+{
+    GtkWindow *window = GTK_WINDOW(gtk_builder_get_object(builder, "mainWindow"));
+    gtk_window_set_title(window, message);
+    g_free(message);
+
+    g_timeout_add_seconds(3, restore_window_title, GUINT_TO_POINTER(++g_status_message_id));
+    return G_SOURCE_REMOVE;
+}
+
+// Called from the emulator or I/O thread, so the message has to be passed to the GUI thread.
+static void on_state_done(const char *path, bool save, bool success)
+{
+    char *basename = g_path_get_basename(path);
+    char *message;
+    if (success)
+        message = g_strdup_printf(save ? "Saved state to %s" : "Loaded state from %s", basename);
+    else
+        message = g_strdup_printf(save ? "Failed to save state to %s" : "Failed to load state from %s", basename);
+    g_free(basename);
+
+    g_idle_add(show_status_message, message);
+}
+
+static void on_movie_event(const char *path, enum retrocore_movie_event event)
+{
+    static const char *const formats[] = {
+        [RETROCORE_MOVIE_RECORDING] = "Recording movie to %s",
+        [RETROCORE_MOVIE_PLAYING] = "Playing movie %s",
+        [RETROCORE_MOVIE_SAVED] = "Saved movie to %s",
+        [RETROCORE_MOVIE_STOPPED] = "Stopped movie %s",
+        [RETROCORE_MOVIE_FINISHED] = "Movie %s finished",
+        [RETROCORE_MOVIE_FAILED] = "Failed to start movie %s",
+    };
+    char *basename = g_path_get_basename(path);
+    g_idle_add(show_status_message, g_strdup_printf(formats[event], basename));
+    g_free(basename);
+}
+
+// Returns the selected file, to be freed with g_free(), or NULL if the dialog was cancelled.
+static char *choose_movie_file(const char *title, GtkFileChooserAction action)
+{
+    GtkWindow *parent_window = GTK_WINDOW(gtk_builder_get_object(builder, "mainWindow"));
+    GtkWidget *dialog = gtk_file_chooser_dialog_new(title,
+                                         parent_window,
+                                         action,
+                                         "_Cancel",
+                                         GTK_RESPONSE_CANCEL,
+                                         action == GTK_FILE_CHOOSER_ACTION_SAVE ? "_Save" : "_Open",
+                                         GTK_RESPONSE_ACCEPT,
+                                         NULL);
+    GtkFileFilter *filter = gtk_file_filter_new();
+    gtk_file_filter_set_name(filter, "Movies");
+    gtk_file_filter_add_pattern(filter, "*.movie");
+    gtk_file_chooser_add_filter(GTK_FILE_CHOOSER(dialog), filter);
+
+    char *filename = NULL;
+    if (action == GTK_FILE_CHOOSER_ACTION_SAVE)
+    {
+        gtk_file_chooser_set_do_overwrite_confirmation(GTK_FILE_CHOOSER(dialog), TRUE);
+        char *movie_path = string_replace_extension(g_current_game_path, ".movie");
+        char *basename = g_path_get_basename(movie_path);
+        gtk_file_chooser_set_current_name(GTK_FILE_CHOOSER(dialog), basename);
+        g_free(basename);
+        free(movie_path);
+    }
+
+    if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT)
+        filename = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
+
+    gtk_widget_destroy(dialog);
+    return filename;
+}
+
+static void on_record_movie_activate(GtkMenuItem *item, gpointer from_power_on)
+{
+    if (!emu_thread)
+        return;
+
+    char *filename = choose_movie_file("Record movie", GTK_FILE_CHOOSER_ACTION_SAVE);
+    if (filename)
+        retrocore_record_movie(filename, GPOINTER_TO_INT(from_power_on));
+    g_free(filename);
+}
+
+static void on_play_movie_activate(GtkMenuItem *item, gpointer unused)
+{
+    if (!emu_thread)
+        return;
+
+    char *filename = choose_movie_file("Play movie", GTK_FILE_CHOOSER_ACTION_OPEN);
+    if (filename)
+        retrocore_play_movie(filename);
+    g_free(filename);
+}
+
+static void on_stop_movie_activate(GtkMenuItem *item, gpointer unused)
+{
+    if (!emu_thread)
+        return;
+
+    retrocore_stop_movie();
+}
+
 static void on_pause_button_activate(GtkMenuItem *button, gpointer data)
 {
     if (!emu_thread)
@@ -506,10 +666,14 @@ static void on_reset_button_activate(GtkMenuItem *button, gpointer data)
     // There is a retro_reset() function in libretro, but using it with the
     // beetle-pce core will trigger various assertion failures. There was no
     // "reset" button on any PC Engine or TurboGrafx-16, so resetting is the
-    // same as just power cycling anyway.
+    // same as just power cycling anyway, which is what loading the state saved
+    // right after the game was loaded does.
+    if (retrocore_reset())
+        return;
+
     char *rom_path2 = strdup(rom_path);
     close_game();
-    load_game(rom_path2);
+    load_game(rom_path2, false);
     free(rom_path2);
 }
 
@@ -564,6 +728,7 @@ void setup_menu_item(const char *name, GCallback callback, gpointer cb_user_data
 void app_quit()
 {
     close_game();
+    retrocore_shutdown();
     if (g_blank_cursor)
     {
         g_object_unref(g_blank_cursor);
@@ -593,6 +758,7 @@ int main(int argc, char **argv)
 
     // Connect signal handlers to the constructed widgets
     window = gtk_builder_get_object(builder, "mainWindow");
+    g_window_title = g_strdup(gtk_window_get_title(GTK_WINDOW(window)));
     g_signal_connect(window, "destroy", G_CALLBACK(app_quit), NULL);
     g_signal_connect(window, "window-state-event", G_CALLBACK(on_window_state_change), NULL);
     g_signal_connect(window, "motion-notify-event", G_CALLBACK(on_mouse_pointer_move), NULL);
@@ -604,6 +770,10 @@ int main(int argc, char **argv)
     setup_menu_item("exitButton", G_CALLBACK(app_quit), builder);
     setup_menu_item("pauseButton", G_CALLBACK(on_pause_button_activate), builder);
     setup_menu_item("resetButton", G_CALLBACK(on_reset_button_activate), builder);
+    setup_menu_item("recordMovie", G_CALLBACK(on_record_movie_activate), GINT_TO_POINTER(FALSE));
+    setup_menu_item("recordMovieFromPowerOn", G_CALLBACK(on_record_movie_activate), GINT_TO_POINTER(TRUE));
+    setup_menu_item("playMovie", G_CALLBACK(on_play_movie_activate), builder);
+    setup_menu_item("stopMovie", G_CALLBACK(on_stop_movie_activate), builder);
     setup_menu_item("fullscreenButton", G_CALLBACK(on_fullscreen_button_activate), builder);
 
     // Create the GtkGlArea
@@ -667,12 +837,12 @@ int main(int argc, char **argv)
     g_signal_connect(G_OBJECT(window), "key_press_event", G_CALLBACK(handle_key_press), NULL);
     g_signal_connect(G_OBJECT(window), "key_release_event", G_CALLBACK(handle_key_release), NULL);
 
-    g_mutex_init(&g_frame_lock);
-    g_cond_init(&g_ready_cond);
+    retrocore_set_state_callback(on_state_done);
+    retrocore_set_movie_callback(on_movie_event);
 
     if (argc > 1)
     {
-        load_game(argv[1]);
+        load_game(argv[1], true);
     }
 
     gtk_main();
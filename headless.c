@@ -0,0 +1,326 @@
+/*
+ * Copyright (c) 2020 Bryan Cain
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Headless frontend for benchmarking. Runs a game for a fixed number of frames
+// as fast as the CPU allows, without the GUI or frame pacing, and reports how
+// long each frame took. With --realtime, the game runs on an emulator thread
+// paced to its frame rate as in the GUI, and the report is how late each frame
+// reached this thread and how many were never seen. testcore.so makes a
+// reproducible load for either: see the TESTCORE_* settings in testcore.c.
+//
+// With --movie, the game is played with the input from a movie recorded in the
+// GUI, until the movie ends. With --hash-log, the video and audio of every frame
+// are hashed and written to a file, one line per frame:
+//
+//   frame video_hash widthxheight audio_hash audio_samples
+//
+// with "-" for the video of frames that weren't rendered. Two runs of the same
+// movie with the same settings should give identical logs, so comparing them
+// checks that a change to the core or the frontend didn't change the output.
+// With --seek, playback jumps to frame N of the movie before the first frame,
+// by way of the nearest keyframe, so the log should match a full run's from
+// that frame on.
+// The hash of the whole run is printed at the end. With --screenshot, the last
+// frame is saved as a PPM image.
+//
+// usage: headless [--frames=N] [--no-video] [--no-audio] [--runahead=N] [--fast-forward] [--preload]
+//                 [--realtime] [--movie=FILE] [--seek=N] [--hash-log=FILE] [--screenshot=FILE] core.so game
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <glib.h>
+#include "SDL.h"
+#include "retrocore.h"
+#include "util.h"
+#include "config.h"
+
+#define DEFAULT_FRAMES 3600
+
+static gint num_frames = 0;
+static gboolean no_video = FALSE;
+static gboolean no_audio = FALSE;
+static gint runahead = 0;
+static gboolean preload = FALSE;
+static gboolean fast_forward = FALSE;
+static gboolean realtime = FALSE;
+static gchar *movie_path = NULL;
+static gint64 seek_frame = 0;
+static gchar *hash_log_path = NULL;
+static gchar *screenshot_path = NULL;
+
+static GOptionEntry entries[] = {
+    { "frames", 'n', 0, G_OPTION_ARG_INT, &num_frames, "Number of frames to run (default: 3600, or until the movie ends)", "N" },
+    { "no-video", 0, 0, G_OPTION_ARG_NONE, &no_video, "Don't copy frames from the core", NULL },
+    { "no-audio", 0, 0, G_OPTION_ARG_NONE, &no_audio, "Don't open an audio device or queue samples", NULL },
+    { "runahead", 0, 0, G_OPTION_ARG_INT, &runahead, "Number of frames to run ahead (default: 0)", "N" },
+    { "fast-forward", 'f', 0, G_OPTION_ARG_NONE, &fast_forward, "Fast-forward, rendering only about 60 frames per second of wall time", NULL },
+    { "preload", 0, 0, G_OPTION_ARG_NONE, &preload, "Load disc images into memory when the core opens them", NULL },
+    { "realtime", 0, 0, G_OPTION_ARG_NONE, &realtime, "Run at the game's speed on an emulator thread, as in the GUI", NULL },
+    { "movie", 'm', 0, G_OPTION_ARG_FILENAME, &movie_path, "Play the game with the input from a movie", "FILE" },
+    { "seek", 0, 0, G_OPTION_ARG_INT64, &seek_frame, "Start playing the movie from frame N", "N" },
+    { "hash-log", 0, 0, G_OPTION_ARG_FILENAME, &hash_log_path, "Write hashes of each frame's video and audio to FILE", "FILE" },
+    { "screenshot", 0, 0, G_OPTION_ARG_FILENAME, &screenshot_path, "Save the last frame to FILE as a PPM image", "FILE" },
+    { NULL }
+};
+
+static FILE *hash_log = NULL;
+static uint64_t run_hash = 0; // hash of all of the frame hashes
+// Set from the emulator thread, which with --realtime isn't this one.
+static atomic_bool movie_running = false;
+static atomic_bool movie_failed = false;
+
+static void on_frame_hash(const struct retrocore_frame_hash *hash)
+{
+    // The frame after the end of the movie isn't part of it.
+    if (movie_path && !atomic_load(&movie_running))
+        return;
+
+    uint64_t values[3] = {run_hash, hash->has_video ? hash->video : 0, hash->audio};
+    run_hash = hash_buffer(values, sizeof(values));
+
+    if (!hash_log)
+        return;
+    if (hash->has_video)
+        fprintf(hash_log, "%lld %016llx %ux%u %016llx %zu\n", (long long) hash->frame,
+                (unsigned long long) hash->video, hash->width, hash->height,
+                (unsigned long long) hash->audio, hash->audio_frames);
+    else
+        fprintf(hash_log, "%lld - - %016llx %zu\n", (long long) hash->frame,
+                (unsigned long long) hash->audio, hash->audio_frames);
+}
+
+static void on_movie_event(const char *path, enum retrocore_movie_event event)
+{
+    if (event == RETROCORE_MOVIE_FAILED)
+        atomic_store(&movie_failed, true);
+    atomic_store(&movie_running, event == RETROCORE_MOVIE_PLAYING);
+}
+
+// Writes an RGB565 frame as a binary PPM, which needs no libraries to write.
+static bool save_screenshot(const char *path, const struct video_frame *frame)
+{
+    FILE *fp = fopen(path, "wb");
+    if (!fp)
+        return false;
+
+    fprintf(fp, "P6\n%u %u\n255\n", frame->width, frame->height);
+    const uint16_t *pixels = (const uint16_t *) frame->data;
+    uint8_t *row = malloc(frame->width * 3);
+    for (unsigned y = 0; y < frame->height; y++)
+    {
+        for (unsigned x = 0; x < frame->width; x++)
+        {
+            uint16_t pixel = pixels[y * frame->width + x];
+            uint8_t r = pixel >> 11, g = (pixel >> 5) & 0x3f, b = pixel & 0x1f;
+            row[x * 3] = (r << 3) | (r >> 2);
+            row[x * 3 + 1] = (g << 2) | (g >> 4);
+            row[x * 3 + 2] = (b << 3) | (b >> 2);
+        }
+        fwrite(row, 3, frame->width, fp);
+    }
+    free(row);
+    return fclose(fp) == 0;
+}
+
+// Without the GUI, this is the thread that displays frames.
+static void take_screenshot(void)
+{
+    struct video_frame *frame = retrocore_get_frame();
+    if (no_video || frame->width == 0)
+        g_printerr("No frame to save to %s\n", screenshot_path);
+    else if (!save_screenshot(screenshot_path, frame))
+        g_printerr("Failed to save %s\n", screenshot_path);
+}
+
+// Runs the emulator thread the way the GUI does, while this thread takes each
+// new frame like a display refreshing at 1 kHz. Records how late each frame was
+// taken after its presentation time, and returns how many frames were missed.
+// The emulator thread unloads the game when it's done.
+static int64_t run_realtime(GArray *lateness, struct retrocore_stats *stats)
+{
+    GThread *thread = g_thread_new("emulator", retrocore_run_game, NULL);
+    int64_t last_frame = -1, missed = 0;
+    while (lateness->len < num_frames && (!movie_path || atomic_load(&movie_running)))
+    {
+        struct video_frame *frame = retrocore_get_frame();
+        if (frame->width && frame->frame_count != last_frame)
+        {
+            double late = retrocore_time() - frame->presentation_time;
+            g_array_append_val(lateness, late);
+            if (last_frame >= 0)
+                missed += frame->frame_count - last_frame - 1;
+            last_frame = frame->frame_count;
+        }
+        g_usleep(1000);
+    }
+
+    if (screenshot_path)
+        take_screenshot();
+    *stats = g_stats;
+    retrocore_close_game();
+    g_thread_join(thread);
+    return missed;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv)
+{
+    GError *error = NULL;
+    GOptionContext *context = g_option_context_new("CORE GAME - run a game headless and time it");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        g_printerr("%s\n", error->message);
+        g_clear_error(&error);
+        return 1;
+    }
+    g_option_context_free(context);
+
+    if (argc != 3 || num_frames < 0 || runahead < 0)
+    {
+        g_printerr("usage: %s [--frames=N] [--no-video] [--no-audio] [--runahead=N] [--fast-forward] [--preload]\n"
+                   "       [--realtime] [--movie=FILE] [--seek=N] [--hash-log=FILE] [--screenshot=FILE] core.so game\n", argv[0]);
+        return 1;
+    }
+    if (seek_frame && (!movie_path || seek_frame < 0))
+    {
+        g_printerr("--seek needs a movie and a frame number of 0 or more\n");
+        return 1;
+    }
+    if (realtime && no_video)
+    {
+        g_printerr("--realtime needs video, since it times the frames shown\n");
+        return 1;
+    }
+    if (num_frames == 0)
+        num_frames = movie_path ? G_MAXINT : DEFAULT_FRAMES;
+
+    if (hash_log_path && !(hash_log = fopen(hash_log_path, "w")))
+    {
+        g_printerr("Failed to open %s\n", hash_log_path);
+        return 1;
+    }
+
+    set_default_config();
+    g_config.frame_pacing = realtime;
+    g_config.resume_enabled = false;
+    g_config.rewind_enabled = false;
+    g_config.video_enabled = !no_video;
+    g_config.audio_enabled = !no_audio;
+    g_config.runahead_frames = runahead;
+    g_config.vfs_preload = preload;
+
+    if (hash_log || movie_path)
+        retrocore_set_hash_callback(on_frame_hash);
+    retrocore_set_movie_callback(on_movie_event);
+    retrocore_init(argv[1]);
+    retrocore_load_game(argv[2]);
+    retrocore_set_fast_forward(fast_forward);
+    if (movie_path)
+    {
+        retrocore_play_movie(movie_path);
+        if (seek_frame)
+            retrocore_seek_movie(seek_frame);
+        atomic_store(&movie_running, true);
+    }
+
+    // In real time, these are how late each frame was shown instead of how long
+    // each took to run.
+    GArray *times = g_array_new(FALSE, FALSE, sizeof(double));
+    struct retrocore_stats stats;
+    int64_t missed = 0;
+    double freq = SDL_GetPerformanceFrequency();
+    Uint64 start = SDL_GetPerformanceCounter();
+    if (realtime)
+    {
+        missed = run_realtime(times, &stats);
+    }
+    else
+    {
+        while (times->len < num_frames && (!movie_path || atomic_load(&movie_running)))
+        {
+            Uint64 frame_start = SDL_GetPerformanceCounter();
+            retrocore_run_frame();
+            double frame_time = (SDL_GetPerformanceCounter() - frame_start) / freq;
+            g_array_append_val(times, frame_time);
+        }
+        if (screenshot_path)
+            take_screenshot();
+        stats = g_stats;
+        retrocore_unload_game();
+    }
+    double wall_time = (SDL_GetPerformanceCounter() - start) / freq;
+    double fps = 1.0 / target_frame_time;
+    retrocore_shutdown();
+    if (hash_log)
+        fclose(hash_log);
+
+    if (atomic_load(&movie_failed))
+    {
+        g_printerr("Failed to play movie %s\n", movie_path);
+        return 1;
+    }
+
+    // A movie that has ended stops just before the next frame.
+    if (movie_path && !atomic_load(&movie_running) && !realtime && times->len > 0)
+        g_array_set_size(times, times->len - 1);
+    num_frames = times->len;
+    double *frame_times = (double *) times->data;
+    if (num_frames == 0)
+    {
+        g_printerr("No frames were run\n");
+        return 1;
+    }
+
+    double total = 0;
+    for (int i = 0; i < num_frames; i++)
+        total += frame_times[i];
+    qsort(frame_times, num_frames, sizeof(double), compare_doubles);
+
+    printf("frames:      %d (video %s, audio %s%s%s)\n", num_frames,
+           no_video ? "off" : "on", no_audio ? "off" : "on", fast_forward ? ", fast-forward" : "",
+           realtime ? ", real time" : "");
+    printf("wall time:   %.3f s\n", wall_time);
+    printf("emulated:    %.1f fps (%.0f%% of %.2f fps)\n",
+           num_frames / wall_time, num_frames / wall_time / fps * 100, fps);
+    printf("%s  min %.3f ms, mean %.3f ms, p99 %.3f ms, max %.3f ms\n",
+           realtime ? "shown late:" : "frame time:",
+           frame_times[0] * 1000, total / num_frames * 1000,
+           frame_times[(int)(num_frames * 0.99)] * 1000, frame_times[num_frames - 1] * 1000);
+    if (realtime)
+        printf("missed:      %lld frames\n", (long long) missed);
+    if (!no_audio)
+        printf("audio:       %llu underruns, %llu overruns\n",
+               (unsigned long long) stats.audio_underruns, (unsigned long long) stats.audio_overruns);
+    if (runahead)
+        printf("run-ahead:   %d frames, %.3f ms extra per frame\n", runahead, stats.runahead_time * 1000);
+    printf("file reads:  longest %.3f ms%s\n", stats.vfs_max_read_time * 1000, preload ? " (preloaded)" : "");
+    if (movie_path)
+        printf("movie:       %s\n", movie_path);
+    if (hash_log || movie_path)
+        printf("output hash: %016llx\n", (unsigned long long) run_hash);
+
+    g_array_free(times, TRUE);
+    return 0;
+}
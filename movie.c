@@ -0,0 +1,448 @@
+/*
+ * Copyright (c) 2020 Bryan Cain
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include "movie.h"
+#include "fileio.h"
+
+#define MOVIE_MAGIC "PCEMOVIE"
+#define MOVIE_VERSION 1
+
+// A keyframe switches from unchanged to changed bytes only after this many
+// unchanged bytes in a row, so that scattered changes don't cost more than
+// they would stored as they are.
+#define MIN_UNCHANGED_RUN 8
+
+// A movie file is the header, followed by the starting state, the save RAM,
+// one uint16_t of input per frame, the keyframe table, and the keyframes.
+struct movie_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t keyframe_interval;
+    uint64_t frames;
+    uint64_t state_size;
+    uint64_t sram_size;
+    uint64_t keyframes;
+};
+
+// Keyframes are in order of frame, which is the frame they come right before.
+// The table follows the inputs, so it usually isn't aligned; entries are
+// copied in and out with memcpy.
+struct keyframe_entry {
+    uint64_t frame;
+    uint64_t offset; // from the start of the file
+    uint64_t size;
+};
+
+static struct keyframe_entry get_keyframe_entry(const uint8_t *table, uint64_t i)
+{
+    struct keyframe_entry entry;
+    memcpy(&entry, table + i * sizeof(entry), sizeof(entry));
+    return entry;
+}
+
+static struct {
+    enum movie_state state;
+    unsigned keyframe_interval;
+    size_t state_size;
+    int64_t position;
+    uint8_t *state_buffer; // for capturing and decoding keyframes
+
+    // When recording, these are owned copies; when playing, they point into the file.
+    const uint8_t *start_state;
+    const uint8_t *sram;
+    size_t sram_size;
+
+    // recording
+    char *path;
+    GArray *inputs;
+    GPtrArray *keyframes; // of GByteArray
+    GArray *keyframe_frames;
+    bool keyframe_due;
+
+    // playing
+    GMappedFile *file;
+    const uint8_t *input_data; // uint16_t inputs, not necessarily aligned
+    int64_t length;
+    const uint8_t *keyframe_table;
+    uint64_t num_keyframes;
+} g_movie = {MOVIE_NONE};
+
+enum movie_state movie_state(void)
+{
+    return g_movie.state;
+}
+
+static void write_varint(GByteArray *out, size_t value)
+{
+    uint8_t byte;
+    while (value >= 0x80)
+    {
+        byte = (value & 0x7f) | 0x80;
+        g_byte_array_append(out, &byte, 1);
+        value >>= 7;
+    }
+    byte = value;
+    g_byte_array_append(out, &byte, 1);
+}
+
+// Returns the number of bytes read, or 0 if the data ends in the middle of it.
+static size_t read_varint(const uint8_t *in, size_t available, size_t *value)
+{
+    size_t result = 0;
+    for (size_t i = 0; i < available && i < 10; i++)
+    {
+        result |= (size_t)(in[i] & 0x7f) << (7 * i);
+        if (!(in[i] & 0x80))
+        {
+            *value = result;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+// Stores the state as alternating runs of unchanged and changed bytes, relative
+// to the starting state: the length of each run, followed by the changed bytes.
+static GByteArray *encode_keyframe(const uint8_t *state)
+{
+    const uint8_t *base = g_movie.start_state;
+    size_t size = g_movie.state_size;
+    GByteArray *out = g_byte_array_new();
+    size_t pos = 0;
+
+    while (pos < size)
+    {
+        size_t unchanged_start = pos;
+        while (pos < size && state[pos] == base[pos])
+            pos++;
+
+        size_t changed_start = pos, unchanged = 0;
+        while (pos < size && unchanged < MIN_UNCHANGED_RUN)
+        {
+            unchanged = state[pos] == base[pos] ? unchanged + 1 : 0;
+            pos++;
+        }
+        if (unchanged == MIN_UNCHANGED_RUN)
+            pos -= unchanged;
+
+        write_varint(out, changed_start - unchanged_start);
+        write_varint(out, pos - changed_start);
+        g_byte_array_append(out, state + changed_start, pos - changed_start);
+    }
+    return out;
+}
+
+static bool decode_keyframe(uint8_t *state, const uint8_t *data, size_t size)
+{
+    memcpy(state, g_movie.start_state, g_movie.state_size);
+
+    size_t pos = 0, in = 0;
+    while (in < size)
+    {
+        size_t unchanged, changed, n;
+        if (!(n = read_varint(data + in, size - in, &unchanged)))
+            return false;
+        in += n;
+        if (!(n = read_varint(data + in, size - in, &changed)))
+            return false;
+        in += n;
+
+        if (unchanged > g_movie.state_size - pos || changed > g_movie.state_size - pos - unchanged ||
+            changed > size - in)
+            return false;
+        pos += unchanged;
+        memcpy(state + pos, data + in, changed);
+        pos += changed;
+        in += changed;
+    }
+    return true;
+}
+
+void movie_record(const char *path, const void *state, size_t state_size,
+                  const void *sram, size_t sram_size, unsigned keyframe_interval)
+{
+    movie_stop();
+
+    g_movie.path = strdup(path);
+    g_movie.keyframe_interval = keyframe_interval ? keyframe_interval : 1;
+    g_movie.state_size = state_size;
+    g_movie.position = 0;
+    g_movie.state_buffer = malloc(state_size);
+
+    uint8_t *start_state = malloc(state_size);
+    memcpy(start_state, state, state_size);
+    g_movie.start_state = start_state;
+    uint8_t *sram_copy = NULL;
+    if (sram_size)
+    {
+        sram_copy = malloc(sram_size);
+        memcpy(sram_copy, sram, sram_size);
+    }
+    g_movie.sram = sram_copy;
+    g_movie.sram_size = sram_size;
+
+    g_movie.inputs = g_array_new(FALSE, FALSE, sizeof(uint16_t));
+    g_movie.keyframes = g_ptr_array_new();
+    g_movie.keyframe_frames = g_array_new(FALSE, FALSE, sizeof(int64_t));
+    g_movie.keyframe_due = false;
+    g_movie.state = MOVIE_RECORDING;
+}
+
+void *movie_keyframe_buffer(void)
+{
+    if (g_movie.state != MOVIE_RECORDING || g_movie.position == 0 ||
+        g_movie.position % g_movie.keyframe_interval != 0)
+        return NULL;
+
+    g_movie.keyframe_due = true;
+    return g_movie.state_buffer;
+}
+
+void movie_add_keyframe(void)
+{
+    if (!g_movie.keyframe_due)
+        return;
+
+    g_ptr_array_add(g_movie.keyframes, encode_keyframe(g_movie.state_buffer));
+    g_array_append_val(g_movie.keyframe_frames, g_movie.position);
+    g_movie.keyframe_due = false;
+}
+
+void movie_record_input(uint16_t input)
+{
+    if (g_movie.state != MOVIE_RECORDING)
+        return;
+
+    g_array_append_val(g_movie.inputs, input);
+    g_movie.position++;
+}
+
+// Called on the I/O thread.
+static void movie_written(const char *path, bool success, void *data, size_t size, void *user_data)
+{
+    printf("%s movie %s\n", success ? "Saved" : "Failed to save", path);
+    free(data);
+}
+
+// Lays out the recording as a movie file and hands it to the I/O thread.
+static void write_movie(void)
+{
+    struct movie_header header = {MOVIE_MAGIC};
+    header.version = MOVIE_VERSION;
+    header.keyframe_interval = g_movie.keyframe_interval;
+    header.frames = g_movie.inputs->len;
+    header.state_size = g_movie.state_size;
+    header.sram_size = g_movie.sram_size;
+    header.keyframes = g_movie.keyframes->len;
+
+    size_t table_offset = sizeof(header) + header.state_size + header.sram_size +
+                          header.frames * sizeof(uint16_t);
+    size_t size = table_offset + header.keyframes * sizeof(struct keyframe_entry);
+    for (guint i = 0; i < g_movie.keyframes->len; i++)
+        size += ((GByteArray *) g_ptr_array_index(g_movie.keyframes, i))->len;
+
+    uint8_t *data = malloc(size);
+    uint8_t *p = data;
+    memcpy(p, &header, sizeof(header));
+    p += sizeof(header);
+    memcpy(p, g_movie.start_state, header.state_size);
+    p += header.state_size;
+    if (header.sram_size)
+        memcpy(p, g_movie.sram, header.sram_size);
+    p += header.sram_size;
+    memcpy(p, g_movie.inputs->data, header.frames * sizeof(uint16_t));
+    p += header.frames * sizeof(uint16_t);
+
+    uint8_t *table = p;
+    p += header.keyframes * sizeof(struct keyframe_entry);
+    for (guint i = 0; i < g_movie.keyframes->len; i++)
+    {
+        GByteArray *keyframe = g_ptr_array_index(g_movie.keyframes, i);
+        struct keyframe_entry entry = { g_array_index(g_movie.keyframe_frames, int64_t, i), p - data, keyframe->len };
+        memcpy(table + i * sizeof(entry), &entry, sizeof(entry));
+        memcpy(p, keyframe->data, keyframe->len);
+        p += keyframe->len;
+    }
+
+    fileio_write(g_movie.path, data, size, movie_written, NULL);
+}
+
+bool movie_play(const char *path, size_t state_size)
+{
+    movie_stop();
+
+    GError *error = NULL;
+    GMappedFile *file = g_mapped_file_new(path, FALSE, &error);
+    if (!file)
+    {
+        printf("Failed to open movie %s: %s\n", path, error->message);
+        g_clear_error(&error);
+        return false;
+    }
+
+    const uint8_t *data = (const uint8_t *) g_mapped_file_get_contents(file);
+    size_t size = g_mapped_file_get_length(file);
+    struct movie_header header = {{0}};
+    if (size >= sizeof(header))
+        memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, MOVIE_MAGIC, sizeof(header.magic)) != 0 || header.version != MOVIE_VERSION)
+    {
+        printf("%s isn't a movie\n", path);
+        g_mapped_file_unref(file);
+        return false;
+    }
+    if (header.state_size != state_size)
+    {
+        printf("Movie %s was recorded with a different core\n", path);
+        g_mapped_file_unref(file);
+        return false;
+    }
+
+    // Check that everything fits in the file before trusting any offsets.
+    uint64_t table_offset = sizeof(header) + header.state_size + header.sram_size +
+                            header.frames * sizeof(uint16_t);
+    bool valid = header.state_size < size && header.sram_size < size && header.frames < size &&
+                 header.keyframes < size && header.keyframe_interval != 0 &&
+                 table_offset + header.keyframes * sizeof(struct keyframe_entry) <= size;
+    const uint8_t *table = data + table_offset;
+    uint64_t last_frame = 0;
+    for (uint64_t i = 0; valid && i < header.keyframes; i++)
+    {
+        struct keyframe_entry entry = get_keyframe_entry(table, i);
+        valid = entry.offset <= size && entry.size <= size - entry.offset &&
+                entry.frame <= header.frames && (i == 0 || entry.frame > last_frame);
+        last_frame = entry.frame;
+    }
+    if (!valid)
+    {
+        printf("Movie %s is truncated or corrupt\n", path);
+        g_mapped_file_unref(file);
+        return false;
+    }
+
+    g_movie.file = file;
+    g_movie.keyframe_interval = header.keyframe_interval;
+    g_movie.state_size = header.state_size;
+    g_movie.start_state = data + sizeof(header);
+    g_movie.sram = g_movie.start_state + header.state_size;
+    g_movie.sram_size = header.sram_size;
+    g_movie.input_data = g_movie.sram + header.sram_size;
+    g_movie.length = header.frames;
+    g_movie.keyframe_table = table;
+    g_movie.num_keyframes = header.keyframes;
+    g_movie.position = 0;
+    g_movie.state_buffer = malloc(header.state_size);
+    g_movie.state = MOVIE_PLAYING;
+    return true;
+}
+
+const void *movie_start_state(void)
+{
+    return g_movie.start_state;
+}
+
+const void *movie_start_sram(size_t *size)
+{
+    *size = g_movie.sram_size;
+    return g_movie.sram;
+}
+
+bool movie_next_input(uint16_t *input)
+{
+    if (g_movie.state != MOVIE_PLAYING || g_movie.position >= g_movie.length)
+        return false;
+
+    uint16_t value;
+    memcpy(&value, g_movie.input_data + g_movie.position++ * sizeof(value), sizeof(value));
+    *input = value;
+    return true;
+}
+
+const void *movie_seek(int64_t frame)
+{
+    if (g_movie.state != MOVIE_PLAYING)
+        return NULL;
+
+    if (frame < 0)
+        frame = 0;
+    if (frame > g_movie.length)
+        frame = g_movie.length;
+
+    // Find the last keyframe at or before frame.
+    uint64_t low = 0, high = g_movie.num_keyframes;
+    while (low < high)
+    {
+        uint64_t mid = low + (high - low) / 2;
+        if (get_keyframe_entry(g_movie.keyframe_table, mid).frame <= (uint64_t) frame)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    // Fall back to earlier keyframes if one is damaged.
+    const uint8_t *file_data = (const uint8_t *) g_mapped_file_get_contents(g_movie.file);
+    for (uint64_t i = low; i > 0; i--)
+    {
+        struct keyframe_entry entry = get_keyframe_entry(g_movie.keyframe_table, i - 1);
+        if (decode_keyframe(g_movie.state_buffer, file_data + entry.offset, entry.size))
+        {
+            g_movie.position = entry.frame;
+            return g_movie.state_buffer;
+        }
+    }
+
+    g_movie.position = 0;
+    return g_movie.start_state;
+}
+
+int64_t movie_position(void)
+{
+    return g_movie.position;
+}
+
+int64_t movie_length(void)
+{
+    return g_movie.state == MOVIE_RECORDING ? g_movie.position : g_movie.length;
+}
+
+void movie_stop(void)
+{
+    if (g_movie.state == MOVIE_RECORDING)
+    {
+        write_movie();
+        free((void *) g_movie.start_state);
+        free((void *) g_movie.sram);
+        g_array_free(g_movie.inputs, TRUE);
+        for (guint i = 0; i < g_movie.keyframes->len; i++)
+            g_byte_array_free(g_ptr_array_index(g_movie.keyframes, i), TRUE);
+        g_ptr_array_free(g_movie.keyframes, TRUE);
+        g_array_free(g_movie.keyframe_frames, TRUE);
+        free(g_movie.path);
+    }
+    else if (g_movie.state == MOVIE_PLAYING)
+    {
+        g_mapped_file_unref(g_movie.file);
+    }
+
+    free(g_movie.state_buffer);
+    memset(&g_movie, 0, sizeof(g_movie));
+    g_movie.state = MOVIE_NONE;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2020 Bryan Cain
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Input movies: the joypad state of every frame, so that a run of a game can be
+// played back exactly. A movie starts from a save state, and has a keyframe (a
+// full state) every keyframe_interval frames, so that playback can seek to any
+// frame by loading the keyframe before it and running at most that many frames.
+// Keyframes only store the bytes that differ from the starting state. All of
+// these functions must be called from the emulator thread.
+//
+// Input is one bit per RETRO_DEVICE_ID_JOYPAD_* button, for player 1.
+
+enum movie_state {
+    MOVIE_NONE,
+    MOVIE_RECORDING,
+    MOVIE_PLAYING,
+};
+
+enum movie_state movie_state(void);
+
+// Starts recording a movie to be written to path. state is the state the movie
+// starts from, and sram the save RAM at that point, since games can behave
+// differently depending on what's saved.
+void movie_record(const char *path, const void *state, size_t state_size,
+                  const void *sram, size_t sram_size, unsigned keyframe_interval);
+
+// Returns a buffer to serialize the current state into if a keyframe is due
+// before the next frame is recorded, or NULL if not.
+void *movie_keyframe_buffer(void);
+
+// Adds the state in the keyframe buffer to the movie.
+void movie_add_keyframe(void);
+
+void movie_record_input(uint16_t input);
+
+// Opens a movie for playback. Returns false if it can't be read or if the
+// state size doesn't match the current core's.
+bool movie_play(const char *path, size_t state_size);
+
+// Gets the state and save RAM the movie being played starts from.
+const void *movie_start_state(void);
+const void *movie_start_sram(size_t *size);
+
+// Gets the input for the next frame of the movie being played. Returns false
+// once the end of the movie is reached.
+bool movie_next_input(uint16_t *input);
+
+// Moves playback to the keyframe at or before frame, and returns its state. The
+// state is valid until the next call to any movie function. To get to frame
+// itself, run the frames from movie_position() with movie_next_input().
+const void *movie_seek(int64_t frame);
+
+// Number of frames recorded or played so far, and the number of frames in the movie.
+int64_t movie_position(void);
+int64_t movie_length(void);
+
+// Stops recording or playback. A recording is written out in the background.
+void movie_stop(void);
+
+#endif
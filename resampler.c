@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2020 Bryan Cain
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "resampler.h"
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+// Number of input samples that contribute to each output sample. Must be a
+// multiple of 4 for the SIMD code.
+#define TAPS 32
+#define HALF_TAPS (TAPS / 2)
+
+// The filter is precomputed at this many fractional positions between input
+// samples, and linearly interpolated between them.
+#define PHASES 256
+
+#define KAISER_BETA 8.0
+
+struct resampler {
+    float *table; // (PHASES + 1) rows of TAPS coefficients
+    float *left, *right; // input history, de-interleaved
+    size_t len, capacity;
+    double pos; // position of the next output sample in the input history
+};
+
+// modified Bessel function of the first kind, order 0
+static double bessel_i0(double x)
+{
+    double sum = 1.0, term = 1.0;
+    for (int k = 1; k < 32; k++)
+    {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+static double sinc(double x)
+{
+    if (fabs(x) < 1e-9)
+        return 1.0;
+    return sin(M_PI * x) / (M_PI * x);
+}
+
+struct resampler *resampler_new(double base_ratio)
+{
+    struct resampler *rs = calloc(1, sizeof(*rs));
+    rs->table = malloc((PHASES + 1) * TAPS * sizeof(float));
+
+    // When downsampling, the cutoff has to drop to the output's Nyquist rate.
+    double cutoff = 0.9 * (base_ratio < 1.0 ? base_ratio : 1.0);
+    for (int p = 0; p <= PHASES; p++)
+    {
+        float *row = &rs->table[p * TAPS];
+        double frac = (double) p / PHASES, sum = 0;
+        for (int k = 0; k < TAPS; k++)
+        {
+            double x = (k - (HALF_TAPS - 1)) - frac;
+            double w = 1.0 - (x / HALF_TAPS) * (x / HALF_TAPS);
+            double window = w > 0 ? bessel_i0(KAISER_BETA * sqrt(w)) / bessel_i0(KAISER_BETA) : 0;
+            row[k] = cutoff * sinc(cutoff * x) * window;
+            sum += row[k];
+        }
+        // normalize for unity gain at DC
+        for (int k = 0; k < TAPS; k++)
+            row[k] /= sum;
+    }
+
+    // Start with silence in the history, so the first output sample can be
+    // centered on the first input sample.
+    rs->capacity = 4096;
+    rs->left = calloc(rs->capacity, sizeof(float));
+    rs->right = calloc(rs->capacity, sizeof(float));
+    rs->len = HALF_TAPS - 1;
+    rs->pos = HALF_TAPS - 1;
+    return rs;
+}
+
+void resampler_free(struct resampler *rs)
+{
+    if (!rs)
+        return;
+    free(rs->table);
+    free(rs->left);
+    free(rs->right);
+    free(rs);
+}
+
+size_t resampler_max_output(size_t in_frames, double ratio)
+{
+    return (size_t) ceil(in_frames * ratio) + 2;
+}
+
+// Applies the filter interpolated between rows c0 and c1 at the given weight.
+static void convolve(const float *left, const float *right, const float *c0, const float *c1,
+                     float weight, float *out_left, float *out_right)
+{
+#if defined(__SSE__)
+    __m128 w = _mm_set1_ps(weight);
+    __m128 sum_left = _mm_setzero_ps(), sum_right = _mm_setzero_ps();
+    for (int k = 0; k < TAPS; k += 4)
+    {
+        __m128 a = _mm_loadu_ps(c0 + k);
+        __m128 coef = _mm_add_ps(a, _mm_mul_ps(w, _mm_sub_ps(_mm_loadu_ps(c1 + k), a)));
+        sum_left = _mm_add_ps(sum_left, _mm_mul_ps(coef, _mm_loadu_ps(left + k)));
+        sum_right = _mm_add_ps(sum_right, _mm_mul_ps(coef, _mm_loadu_ps(right + k)));
+    }
+    float l[4], r[4];
+    _mm_storeu_ps(l, sum_left);
+    _mm_storeu_ps(r, sum_right);
+    *out_left = (l[0] + l[1]) + (l[2] + l[3]);
+    *out_right = (r[0] + r[1]) + (r[2] + r[3]);
+#else
+    float sum_left = 0, sum_right = 0;
+    for (int k = 0; k < TAPS; k++)
+    {
+        float coef = c0[k] + weight * (c1[k] - c0[k]);
+        sum_left += coef * left[k];
+        sum_right += coef * right[k];
+    }
+    *out_left = sum_left;
+    *out_right = sum_right;
+#endif
+}
+
+static int16_t to_int16(float sample)
+{
+    if (sample > 32767.0f)
+        return 32767;
+    if (sample < -32768.0f)
+        return -32768;
+    return (int16_t) lrintf(sample);
+}
+
+size_t resampler_process(struct resampler *rs, const int16_t *in, size_t in_frames,
+                         int16_t *out, double ratio)
+{
+    if (rs->len + in_frames > rs->capacity)
+    {
+        while (rs->len + in_frames > rs->capacity)
+            rs->capacity *= 2;
+        rs->left = realloc(rs->left, rs->capacity * sizeof(float));
+        rs->right = realloc(rs->right, rs->capacity * sizeof(float));
+    }
+    for (size_t i = 0; i < in_frames; i++)
+    {
+        rs->left[rs->len + i] = in[i * 2];
+        rs->right[rs->len + i] = in[i * 2 + 1];
+    }
+    rs->len += in_frames;
+
+    double step = 1.0 / ratio;
+    size_t out_frames = 0;
+    while ((size_t) rs->pos + HALF_TAPS < rs->len)
+    {
+        size_t index = (size_t) rs->pos;
+        double phase = (rs->pos - index) * PHASES;
+        int row = (int) phase;
+        size_t start = index - (HALF_TAPS - 1);
+
+        float l, r;
+        convolve(rs->left + start, rs->right + start, &rs->table[row * TAPS],
+                 &rs->table[(row + 1) * TAPS], phase - row, &l, &r);
+        out[out_frames * 2] = to_int16(l);
+        out[out_frames * 2 + 1] = to_int16(r);
+        out_frames++;
+        rs->pos += step;
+    }
+
+    // Drop the input that no future output sample will need.
+    size_t consumed = (size_t) rs->pos - (HALF_TAPS - 1);
+    if (consumed > rs->len)
+        consumed = rs->len;
+    memmove(rs->left, rs->left + consumed, (rs->len - consumed) * sizeof(float));
+    memmove(rs->right, rs->right + consumed, (rs->len - consumed) * sizeof(float));
+    rs->len -= consumed;
+    rs->pos -= consumed;
+
+    return out_frames;
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2020 Bryan Cain
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Windowed sinc resampler for interleaved 16-bit stereo audio. The ratio can
+// be changed on every call, which is used for dynamic rate control. This has
+// no dependencies on the rest of the frontend, so it can be benchmarked alone.
+
+struct resampler;
+
+// base_ratio is the output rate divided by the input rate. It only determines
+// the filter's cutoff frequency; the actual ratio is passed to resampler_process.
+struct resampler *resampler_new(double base_ratio);
+void resampler_free(struct resampler *rs);
+
+// Returns the maximum number of frames resampler_process can output for the
+// given number of input frames at the given ratio.
+size_t resampler_max_output(size_t in_frames, double ratio);
+
+// Resamples in_frames frames from in into out, returning the number of frames
+// written. Input that isn't used up yet is kept for the next call.
+size_t resampler_process(struct resampler *rs, const int16_t *in, size_t in_frames,
+                         int16_t *out, double ratio);
+
+#endif
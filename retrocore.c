@@ -3,9 +3,17 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include "SDL.h"
 #include "libretro.h"
 #include "retrocore.h"
+#include "audio.h"
+#include "rewind.h"
+#include "fileio.h"
+#include "sram.h"
+#include "bootcache.h"
+#include "vfs.h"
+#include "movie.h"
 #include "util.h"
 #include "config.h"
 
@@ -13,26 +21,134 @@
 #include <gdk/gdk.h>
 
 // exported globals
-struct video_frame g_frames[2] = {{0}, {0}};
-int g_next_frame = 0;
+struct retrocore_stats g_stats = {0};
 double target_frame_time = 0.165;
 char *g_current_game_path = NULL;
 
 // local globals
 static bool running = false;
 static int64_t frame_count = 0;
-static uint8_t last_sram[2048] = {0};
 static Uint64 start_time = 0;
 static Uint64 pause_time;
 static bool paused = false;
 static char *g_save_state_path = NULL;
-static char *g_load_state_path = NULL;
+static bool g_rewind_held = false;
+static int64_t last_rewind_capture = 0;
 
+// Maximum time per frame to spend compressing rewind states, in seconds.
+#define REWIND_BUDGET 0.0005
+
+// The core looks for BIOS files in the system directory. CD games use the System Card 3.0 BIOS.
+#define SYSTEM_DIRECTORY "."
+#define BIOS_PATH SYSTEM_DIRECTORY "/syscard3.pce"
+
+// Which outputs of the core are used for the current frame. Same format as
+// RETRO_ENVIRONMENT_GET_AUDIO_VIDEO_ENABLE.
+#define AV_ENABLE_VIDEO 1
+#define AV_ENABLE_AUDIO 2
+static int av_enable = AV_ENABLE_VIDEO | AV_ENABLE_AUDIO;
+
+// time spent waiting for the GUI in video_refresh, in performance counter ticks
+static Uint64 pacing_wait_ticks = 0;
+
+// Frame frame_count is presented at time + (frame_count - frame) * target_frame_time / speed.
+// When the speed changes, the clock is moved to the current frame so that the
+// presentation times stay continuous.
+static struct {
+    int64_t frame;
+    double time;
+    double speed; // 0 = unthrottled
+} g_clock = {0, 0, 1};
+
+static struct {
+    atomic_bool requested;
+    bool active;
+    bool key_down;
+    double next_video_time;
+} g_fast_forward = {0};
+
+// Auto-turbo fast-forwards through loading screens: the picture doesn't change,
+// there's no sound and no input, and the core is reading from the disc.
+#define AUTO_TURBO_IDLE_FRAMES 20   // idle frames before fast-forwarding
+#define AUTO_TURBO_READ_WINDOW 120  // a disc read within this many frames means it's loading
+#define SILENCE_THRESHOLD 64
+
+static struct {
+    bool engaged;
+    uint64_t frame_hash;
+    bool video_changed; // these three are reset every frame
+    bool audio_active;
+    bool input_active;
+    unsigned idle_frames;
+    uint64_t bytes_read;
+    int64_t last_read_frame;
+} g_auto_turbo = {0};
+
+// When the host can't keep up, frames are run without video until the emulator
+// catches up, so the game and its audio still run at full speed.
 static struct {
-    SDL_AudioDeviceID device;
-    uint64_t samples_played;
-    int sample_rate;
-} g_audio = {0};
+    double render_cost; // moving average of the time to run a frame with video, in seconds
+    unsigned consecutive;
+    unsigned skipped;
+    unsigned frames;
+} g_frameskip = {0};
+
+// Hashes of each frame's video and audio, when there's a callback to pass them to.
+static struct {
+    retrocore_hash_callback callback;
+    bool has_video;
+    uint64_t video;
+    unsigned width;
+    unsigned height;
+    int16_t *audio; // interleaved stereo
+    size_t audio_frames;
+    size_t audio_capacity;
+} g_hash = {0};
+
+// Frames are passed from the emulator thread to the GUI through a lock-free
+// triple buffer. The emulator thread renders into g_frames[back] and then swaps
+// it with "ready". The GUI swaps "ready" with "front" whenever it holds a frame
+// that hasn't been displayed yet, so it always gets the newest complete frame.
+#define FRAME_INDEX_MASK 3
+#define FRAME_IS_NEW 4
+
+static struct video_frame g_frames[3] = {{0}, {0}, {0}};
+
+static struct {
+    unsigned max_width;
+    unsigned max_height;
+    int back;  // only used by the emulator thread
+    int front; // only used by the GUI thread
+    atomic_int ready;
+} g_video = {0, 0, 0, 2, 1};
+
+// Used to wait until it's time for a frame to be displayed.
+static GMutex g_pace_lock = {0};
+static GCond g_pace_cond = {0};
+
+static struct {
+    void *state;
+    size_t state_size;
+    Uint64 extra_ticks;
+    int frames;
+} g_runahead = {0};
+
+static bool g_audio_open = false;
+
+// The state right after the game was loaded, so that resetting doesn't have to
+// reload the core and the game.
+static struct {
+    void *state;
+    size_t size;
+    atomic_bool requested;
+} g_power_on = {0};
+
+// The boot cache lets the game skip straight to the end of its boot sequence.
+static struct {
+    bool skipped; // whether the cached state was loaded (or it's too late to)
+    int64_t power_on_frame; // frame_count at the last power-on, since resets don't rewind frame_count
+    atomic_bool capture_requested;
+} g_boot = {0};
 
 
 static struct {
@@ -60,6 +176,9 @@ static struct {
 	size_t (*retro_get_memory_size)(unsigned id);
 } g_retro;
 
+// The ROM, mapped for cores that take the game's contents instead of its path.
+static GMappedFile *g_rom_file = NULL;
+
 
 struct keymap {
 	unsigned k;
@@ -68,6 +187,11 @@ struct keymap {
 
 static unsigned g_joy[RETRO_DEVICE_ID_JOYPAD_R3+1] = { 0 };
 
+// The joypad state for the current frame, one bit per RETRO_DEVICE_ID_JOYPAD_*.
+// It's latched from g_joy or the movie being played at the start of each frame,
+// so that every run of a frame (with run-ahead) sees the same input.
+static uint16_t g_input = 0;
+
 #define load_sym(V, S) do {\
     if (!((*(void**)&V) = SDL_LoadFunction(g_retro.handle, #S))) \
         die("Failed to load symbol '" #S "'': %s", SDL_GetError()); \
@@ -109,7 +233,7 @@ void retrocore_pause(void)
 
     paused = true;
     pause_time = SDL_GetPerformanceCounter();
-    SDL_PauseAudioDevice(g_audio.device, 1);
+    audio_pause(true);
 }
 
 // Unpauses the emulation.
@@ -120,7 +244,13 @@ void retrocore_unpause(void)
 
     paused = false;
     start_time += SDL_GetPerformanceCounter() - pause_time;
-    SDL_PauseAudioDevice(g_audio.device, 0);
+    // Fast-forward keeps the device paused; update_fast_forward() resumes it.
+    if (!g_fast_forward.active)
+        audio_pause(false);
+
+    g_mutex_lock(&g_pace_lock);
+    g_cond_signal(&g_pace_cond);
+    g_mutex_unlock(&g_pace_lock);
 }
 
 void retrocore_toggle_pause(void)
@@ -131,6 +261,11 @@ void retrocore_toggle_pause(void)
         retrocore_pause();
 }
 
+void retrocore_set_fast_forward(bool enabled)
+{
+    atomic_store(&g_fast_forward.requested, enabled);
+}
+
 void handle_key_event(unsigned keyval, bool pressed)
 {
     // account for caps lock; 'A' and 'a' are the same thing for our purposes
@@ -139,6 +274,22 @@ void handle_key_event(unsigned keyval, bool pressed)
         keyval = tolower(keyval);
     }
 
+    if (keyval == g_config.rewind_key)
+        g_rewind_held = pressed;
+
+    if (keyval == g_config.fast_forward_key)
+    {
+        // Ignore key repeat, or holding the key would keep toggling.
+        if (!g_config.fast_forward_toggle)
+            retrocore_set_fast_forward(pressed);
+        else if (pressed && !g_fast_forward.key_down)
+            retrocore_set_fast_forward(!atomic_load(&g_fast_forward.requested));
+        g_fast_forward.key_down = pressed;
+    }
+
+    if (keyval == g_config.boot_cache_key && pressed && g_config.boot_cache_enabled)
+        atomic_store(&g_boot.capture_requested, true);
+
     int i;
     for (i = 0; g_config.g_binds[i]; ++i)
     {
@@ -147,104 +298,145 @@ void handle_key_event(unsigned keyval, bool pressed)
     }
 }
 
-static void video_refresh(const void *data, unsigned width, unsigned height, size_t pitch)
+// Returns when the current frame should be shown, by g_clock.
+static double frame_presentation_time(void)
+{
+    if (g_clock.speed == 0)
+        return g_clock.time;
+    return g_clock.time + (frame_count - g_clock.frame) * target_frame_time / g_clock.speed;
+}
+
+static void set_speed(double speed)
 {
-    g_mutex_lock(&g_frame_lock);
-    // Check "running" here because if it's false, the GUI thread is waiting for this thread to
-    // exit, so waiting on the condition would cause a deadlock.
-    if (running && retrocore_time() < g_frames[g_next_frame].presentation_time)
+    g_clock.time = g_clock.speed == 0 ? retrocore_time() : frame_presentation_time();
+    g_clock.frame = frame_count;
+    g_clock.speed = speed;
+}
+
+// Waits until the given frame's presentation time, or until the game is closed.
+static void wait_until(double presentation_time)
+{
+    Uint64 wait_start = SDL_GetPerformanceCounter();
+    g_mutex_lock(&g_pace_lock);
+    while (running)
     {
-        g_cond_wait(&g_ready_cond, &g_frame_lock);
-        //printf("Frame %li woke up %.1f ms early at %.3f s\n", frame_count, (frame_count * target_frame_time - retrocore_time()) * 1000, retrocore_time());
+        double remaining = presentation_time - retrocore_time();
+        if (remaining <= 0)
+            break;
+
+        // Wake up periodically in case the emulator is paused, since the clock
+        // stops while paused.
+        gint64 end_time = g_get_monotonic_time() + MIN(remaining, 0.1) * G_USEC_PER_SEC;
+        g_cond_wait_until(&g_pace_cond, &g_pace_lock, end_time);
     }
+    g_mutex_unlock(&g_pace_lock);
+    pacing_wait_ticks += SDL_GetPerformanceCounter() - wait_start;
+}
 
-    g_next_frame = !g_next_frame;
-    struct video_frame *frame = &g_frames[g_next_frame];
+static void wait_while_paused(void)
+{
+    g_mutex_lock(&g_pace_lock);
+    while (running && paused)
+        g_cond_wait_until(&g_pace_cond, &g_pace_lock, g_get_monotonic_time() + G_USEC_PER_SEC / 10);
+    g_mutex_unlock(&g_pace_lock);
+}
 
-    if (frame->width != width || frame->height != height || frame->data == NULL)
-    {
-		printf("resolution changed to %u*%u\n", width, height);
-		frame->data = realloc(frame->data, width * height * 2);
-	}
+static void video_refresh(const void *data, unsigned width, unsigned height, size_t pitch)
+{
+    if (!g_config.video_enabled || !(av_enable & AV_ENABLE_VIDEO))
+        return;
 
+    struct video_frame *frame = &g_frames[g_video.back];
     frame->frame_count = frame_count;
-    frame->presentation_time = frame_count * target_frame_time;
-    frame->width = width;
-    frame->height = height;
+    frame->presentation_time = frame_presentation_time();
+
+    // If the frame is a dupe, just keep displaying the previous one.
     if (data && data != RETRO_HW_FRAME_BUFFER_VALID)
     {
-        const uint8_t *src = (const uint8_t*) data;
-        uint8_t *dst = (uint8_t*) frame->data;
-        for (int y = 0; y < height; ++y)
-        {
-            memcpy(dst, src, width * 2);
-            src += pitch;
-            dst += width * 2;
-        }
+        g_assert(width <= g_video.max_width && height <= g_video.max_height);
+        if (frame->width != width || frame->height != height)
+            printf("resolution changed to %u*%u\n", width, height);
+        frame->width = width;
+        frame->height = height;
+
+        // No need to copy if the core rendered straight into the buffer.
+        if (data != frame->data || pitch != width * 2)
+            copy_rows(frame->data, width * 2, data, pitch, width * 2, height);
+    }
+
+    if ((g_config.auto_turbo || g_hash.callback) && data && data != RETRO_HW_FRAME_BUFFER_VALID)
+    {
+        uint64_t hash = hash_buffer(frame->data, width * height * 2);
+        g_auto_turbo.video_changed |= hash != g_auto_turbo.frame_hash;
+        g_auto_turbo.frame_hash = hash;
+        g_hash.video = hash;
+        g_hash.width = width;
+        g_hash.height = height;
     }
-    //if (retrocore_time() >= frame->presentation_time)
+    g_hash.has_video = true; // a dupe shows the same picture as the last frame
+
+    if (g_config.frame_pacing)
+        wait_until(frame->presentation_time);
+    //if (retrocore_time() >= frame->presentation_time + target_frame_time)
     //    printf("Frame %li finished %.1f ms late at %.3f s\n", frame_count, (retrocore_time() - frame->presentation_time) * 1000, retrocore_time());
-    g_mutex_unlock(&g_frame_lock);
+
+    if (data && data != RETRO_HW_FRAME_BUFFER_VALID)
+    {
+        int old = atomic_exchange(&g_video.ready, g_video.back | FRAME_IS_NEW);
+        g_video.back = old & FRAME_INDEX_MASK;
+    }
 }
 
-static void video_deinit()
+struct video_frame *retrocore_get_frame(void)
 {
-    free(g_frames[0].data);
-    free(g_frames[1].data);
-    memset(g_frames, 0, sizeof(g_frames));
-    g_next_frame = 0;
+    if (atomic_load(&g_video.ready) & FRAME_IS_NEW)
+    {
+        int old = atomic_exchange(&g_video.ready, g_video.front);
+        g_video.front = old & FRAME_INDEX_MASK;
+    }
+    return &g_frames[g_video.front];
 }
 
-
-static void audio_init(int frequency)
+void retrocore_get_max_frame_size(unsigned *width, unsigned *height)
 {
-    SDL_AudioSpec desired;
-    SDL_AudioSpec obtained;
-
-    SDL_zero(desired);
-    SDL_zero(obtained);
-
-    desired.format = AUDIO_S16;
-    desired.freq   = frequency;
-    desired.channels = 2;
-    desired.samples = 1596;
-
-    g_audio.device = SDL_OpenAudioDevice(NULL, 0, &desired, &obtained, 0);
-    if (!g_audio.device)
-        die("Failed to open playback device: %s", SDL_GetError());
-
-    SDL_PauseAudioDevice(g_audio.device, 0);
-    g_audio.sample_rate = frequency;
+    *width = g_video.max_width;
+    *height = g_video.max_height;
 }
 
+// Allocates all of the frame buffers at the core's maximum resolution, so that
+// the core can render into any of them.
+static void video_init(unsigned max_width, unsigned max_height)
+{
+    size_t size = max_width * max_height * 2;
+    g_video.max_width = max_width;
+    g_video.max_height = max_height;
+    for (int i = 0; i < 3; i++)
+        g_frames[i].data = calloc(1, size);
+}
 
-static void audio_deinit()
+static void video_deinit()
 {
-    SDL_CloseAudioDevice(g_audio.device);
-    g_audio.samples_played = 0;
+    for (int i = 0; i < 3; i++)
+        free(g_frames[i].data);
+    memset(g_frames, 0, sizeof(g_frames));
+    g_video.max_width = g_video.max_height = 0;
+    g_video.back = 0;
+    g_video.front = 2;
+    atomic_store(&g_video.ready, 1);
 }
 
-static size_t audio_write(const int16_t *buf, unsigned frames)
+// Gives the core the back buffer to render the next frame into, to save a copy.
+static bool get_software_framebuffer(struct retro_framebuffer *fb)
 {
-    // If there's been a break in audio playback, and the audio is more than 100 ms
-    // behind where it should be, change the clock to re-sync video to audio.
-    if (SDL_GetQueuedAudioSize(g_audio.device) == 0)
-    {
-        double regular_time = retrocore_time();
-        double audio_time = (double)g_audio.samples_played / g_audio.sample_rate;
-        double difference = (regular_time - audio_time);
-        if (difference >= .05) // 50 ms
-        {
-            start_time += (regular_time - audio_time) * SDL_GetPerformanceFrequency();
-            printf("resync video; move %f ms\n", difference * 1000);
-        }
-        //else
-        //    printf("queue empty but not resyncing video; difference is only %.1f ms\n", difference * 1000);
-    }
+    struct video_frame *frame = &g_frames[g_video.back];
+    if (!frame->data || fb->width > g_video.max_width || fb->height > g_video.max_height)
+        return false;
 
-    int ret = SDL_QueueAudio(g_audio.device, buf, sizeof(*buf) * frames * 2);
-    g_audio.samples_played += frames;
-    return frames;
+    fb->data = frame->data;
+    fb->pitch = fb->width * 2;
+    fb->format = RETRO_PIXEL_FORMAT_RGB565;
+    fb->memory_flags = RETRO_MEMORY_TYPE_CACHED;
+    return true;
 }
 
 
@@ -268,6 +460,18 @@ static void core_log(enum retro_log_level level, const char *fmt, ...)
 		exit(EXIT_FAILURE);
 }
 
+// Which outputs the core should produce for this frame, given what the frontend uses.
+static int core_av_enable(void)
+{
+    int outputs = av_enable;
+    if (!g_config.video_enabled)
+        outputs &= ~AV_ENABLE_VIDEO;
+    // Without an audio device, the audio is still needed for hashing.
+    if (!g_audio_open && !g_hash.callback)
+        outputs &= ~AV_ENABLE_AUDIO;
+    return outputs;
+}
+
 static bool core_environment(unsigned cmd, void *data)
 {
 	bool *bval;
@@ -290,9 +494,27 @@ static bool core_environment(unsigned cmd, void *data)
 
 		return true;
 	}
+    case RETRO_ENVIRONMENT_GET_CURRENT_SOFTWARE_FRAMEBUFFER:
+        return get_software_framebuffer((struct retro_framebuffer *)data);
+    case RETRO_ENVIRONMENT_GET_AUDIO_VIDEO_ENABLE:
+        if (data)
+            *(int *)data = core_av_enable();
+        return true;
+    case RETRO_ENVIRONMENT_GET_FASTFORWARDING:
+        if (data)
+            *(bool *)data = g_fast_forward.active;
+        return true;
+    case RETRO_ENVIRONMENT_GET_VFS_INTERFACE: {
+        struct retro_vfs_interface_info *info = (struct retro_vfs_interface_info *)data;
+        if (info->required_interface_version > VFS_INTERFACE_VERSION)
+            return false;
+        info->required_interface_version = VFS_INTERFACE_VERSION;
+        info->iface = vfs_get_interface();
+        return true;
+    }
     case RETRO_ENVIRONMENT_GET_SYSTEM_DIRECTORY:
     case RETRO_ENVIRONMENT_GET_SAVE_DIRECTORY:
-        *(const char **)data = ".";
+        *(const char **)data = SYSTEM_DIRECTORY;
         return true;
 	default:
 		core_log(RETRO_LOG_DEBUG, "Unhandled env #%u", cmd);
@@ -313,22 +535,82 @@ static int16_t core_input_state(unsigned port, unsigned device, unsigned index,
 	if (port || index || device != RETRO_DEVICE_JOYPAD)
 		return 0;
 
-	return g_joy[id];
+    if (id > RETRO_DEVICE_ID_JOYPAD_R3)
+        return 0;
+
+    bool pressed = g_input & (1 << id);
+    g_auto_turbo.input_active |= pressed;
+    return pressed;
+}
+
+
+// Auto-turbo treats audio this quiet as silence.
+static bool is_silent(const int16_t *data, size_t samples)
+{
+    for (size_t i = 0; i < samples; i++)
+    {
+        if (data[i] > SILENCE_THRESHOLD || data[i] < -SILENCE_THRESHOLD)
+            return false;
+    }
+    return true;
+}
+
+// Audio is still sent to the core while auto-turbo is on, so that it can tell
+// when the sound comes back, but it isn't played.
+static bool should_queue_audio(void)
+{
+    return g_audio_open && (av_enable & AV_ENABLE_AUDIO) && !g_fast_forward.active;
 }
 
+// Collects the frame's audio to be hashed, so the hash doesn't depend on which
+// callback the core uses or how it splits up the samples.
+static void collect_audio_for_hash(const int16_t *data, size_t frames)
+{
+    if (!(av_enable & AV_ENABLE_AUDIO))
+        return;
 
+    if (g_hash.audio_frames + frames > g_hash.audio_capacity)
+    {
+        g_hash.audio_capacity = MAX(g_hash.audio_capacity * 2, g_hash.audio_frames + frames);
+        g_hash.audio = realloc(g_hash.audio, g_hash.audio_capacity * 2 * sizeof(int16_t));
+    }
+    memcpy(g_hash.audio + g_hash.audio_frames * 2, data, frames * 2 * sizeof(int16_t));
+    g_hash.audio_frames += frames;
+}
+
+// Audio is collected over the whole frame and written out at the end of
+// retrocore_run_frame(), no matter which callback the core uses.
 static void core_audio_sample(int16_t left, int16_t right)
 {
-	int16_t buf[2] = {left, right};
-	audio_write(buf, 1);
+    if (g_config.auto_turbo)
+    {
+        int16_t samples[2] = {left, right};
+        g_auto_turbo.audio_active |= !is_silent(samples, 2);
+    }
+
+    if (g_hash.callback)
+    {
+        int16_t samples[2] = {left, right};
+        collect_audio_for_hash(samples, 1);
+    }
+
+    if (should_queue_audio())
+        audio_sample(left, right);
 }
 
 
 static size_t core_audio_sample_batch(const int16_t *data, size_t frames)
 {
-	return audio_write(data, frames);
-}
+    if (g_config.auto_turbo && !g_auto_turbo.audio_active)
+        g_auto_turbo.audio_active = !is_silent(data, frames * 2);
 
+    if (g_hash.callback)
+        collect_audio_for_hash(data, frames);
+
+    if (should_queue_audio())
+        audio_batch(data, frames);
+    return frames;
+}
 
 static void core_load(const char *sofile)
 {
@@ -384,26 +666,41 @@ static void core_load_game(const char *filename)
 	struct retro_system_info system = {0};
 	struct retro_game_info info = { filename, 0 };
 
-    SDL_RWops *file = SDL_RWFromFile(filename, "rb");
-
-    if (!file)
-        die("Failed to load %s: %s", filename, SDL_GetError());
+	g_retro.retro_get_system_info(&system);
 
     info.path = filename;
     info.meta = "";
-    info.data = NULL;
-    info.size = SDL_RWsize(file);
-
-	g_retro.retro_get_system_info(&system);
+    if (system.need_fullpath)
+    {
+        if (!g_file_test(filename, G_FILE_TEST_IS_REGULAR))
+            die("Failed to load %s: file not found", filename);
+        info.data = NULL;
+        info.size = 0;
+    }
+    else
+    {
+        // Hand the core the mapped file instead of making it open and read its own copy.
+        GError *error = NULL;
+        g_rom_file = g_mapped_file_new(filename, FALSE, &error);
+        if (!g_rom_file)
+            die("Failed to load %s: %s", filename, error->message);
+        info.data = g_mapped_file_get_contents(g_rom_file);
+        info.size = g_mapped_file_get_length(g_rom_file);
+    }
 
 	if (!g_retro.retro_load_game(&info))
 		die("The core failed to load the content.");
 
 	g_retro.retro_get_system_av_info(&av);
-	audio_init(av.timing.sample_rate);
+	if (g_config.video_enabled)
+		video_init(av.geometry.max_width, av.geometry.max_height);
+	if (g_config.audio_enabled)
+	{
+		if (!audio_init(av.timing.sample_rate, g_config.audio_latency_ms))
+			die("Failed to open playback device: %s", SDL_GetError());
+		g_audio_open = true;
+	}
 	target_frame_time = 1.0 / av.timing.fps;
-
-    SDL_RWclose(file);
 }
 
 static void core_unload()
@@ -415,6 +712,13 @@ static void core_unload()
 		g_retro.initialized = false;
     }
 
+    // The core may use the game data it was given until it's unloaded.
+    if (g_rom_file)
+    {
+        g_mapped_file_unref(g_rom_file);
+        g_rom_file = NULL;
+    }
+
 	if (g_retro.handle)
 	{
         SDL_UnloadObject(g_retro.handle);
@@ -422,98 +726,212 @@ static void core_unload()
     }
 }
 
-static bool load_sram(const char *path)
+// Save state buffers are reused between saves, and go back into this pool once
+// the I/O thread has written them out.
+struct state_buffer {
+    void *data;
+    size_t capacity;
+};
+
+// A save state read from disk by the I/O thread, waiting for the emulator thread
+// to load it at the next frame boundary.
+struct loaded_state {
+    char *path;
+    void *data;
+    size_t size;
+    int generation;
+};
+
+static GAsyncQueue *g_free_state_buffers = NULL;
+static GAsyncQueue *g_loaded_states = NULL;
+static retrocore_state_callback g_state_callback = NULL;
+
+// Movie requests from the GUI thread, carried out at the start of the next frame.
+enum movie_command_type {
+    MOVIE_COMMAND_RECORD,
+    MOVIE_COMMAND_RECORD_FROM_POWER_ON,
+    MOVIE_COMMAND_PLAY,
+    MOVIE_COMMAND_STOP,
+    MOVIE_COMMAND_SEEK,
+};
+
+struct movie_command {
+    enum movie_command_type type;
+    char *path;
+    int64_t frame;
+};
+
+static GAsyncQueue *g_movie_commands = NULL;
+static retrocore_movie_callback g_movie_callback = NULL;
+static char *g_movie_path = NULL; // the movie being recorded or played
+
+// Incremented for each game loaded, so that a state requested for one game is
+// never loaded into another.
+static atomic_int g_game_generation = 0;
+
+void retrocore_set_state_callback(retrocore_state_callback callback)
+{
+    g_state_callback = callback;
+}
+
+static void report_state_result(const char *path, bool save, bool success)
 {
-    FILE *fp;
-    void *sram = g_retro.retro_get_memory_data(RETRO_MEMORY_SAVE_RAM);
-    size_t size = g_retro.retro_get_memory_size(RETRO_MEMORY_SAVE_RAM);
+    printf("%s state %s %s\n", success ? (save ? "Saved" : "Loaded") : (save ? "Failed to save" : "Failed to load"),
+           save ? "to" : "from", path);
+    if (g_state_callback)
+        g_state_callback(path, save, success);
+}
 
-    if (!sram) return false;
-    g_assert(size == sizeof(last_sram));
-    fp = fopen(path, "rb");
-    if (!fp) return false;
-    if (fread(last_sram, 1, size, fp) != size)
+static struct state_buffer *get_state_buffer(size_t size)
+{
+    struct state_buffer *buffer = g_async_queue_try_pop(g_free_state_buffers);
+    if (!buffer)
+        buffer = calloc(1, sizeof(*buffer));
+    if (buffer->capacity < size)
     {
-        fclose(fp);
-        return false;
+        free(buffer->data);
+        buffer->data = malloc(size);
+        buffer->capacity = size;
     }
-    fclose(fp);
-    memcpy(sram, last_sram, size);
-    return true;
+    return buffer;
 }
 
-static bool save_sram(const char *path)
+// Called on the I/O thread.
+static void state_written(const char *path, bool success, void *data, size_t size, void *user_data)
 {
-    FILE *fp;
-    void *sram = g_retro.retro_get_memory_data(RETRO_MEMORY_SAVE_RAM);
-    size_t size = g_retro.retro_get_memory_size(RETRO_MEMORY_SAVE_RAM);
+    g_async_queue_push(g_free_state_buffers, user_data);
+    report_state_result(path, true, success);
+}
 
-    if (!sram) return false;
-    fp = fopen(path, "wb");
-    if (!fp) return false;
-    if (fwrite(sram, 1, size, fp) != size)
+// Called on the I/O thread.
+static void state_read(const char *path, bool success, void *data, size_t size, void *user_data)
+{
+    if (!success)
     {
-        fclose(fp);
-        return false;
+        report_state_result(path, false, false);
+        return;
     }
-    fclose(fp);
-    return true;
+
+    struct loaded_state *state = malloc(sizeof(*state));
+    state->path = strdup(path);
+    state->data = data;
+    state->size = size;
+    state->generation = GPOINTER_TO_INT(user_data);
+    g_async_queue_push(g_loaded_states, state);
 }
 
-bool load_state_actual(const char *save_path)
+// Called on the I/O thread.
+static void resume_state_written(const char *path, bool success, void *data, size_t size, void *user_data)
+{
+    g_async_queue_push(g_free_state_buffers, user_data);
+    printf("%s resume state %s\n", success ? "Saved" : "Failed to save", path);
+}
+
+// Saves the state to the game's resume file in the background, so that closing stays instant.
+static void save_resume_state(void)
 {
     size_t size = g_retro.retro_serialize_size();
-    void *state = malloc(size);
+    struct state_buffer *buffer = get_state_buffer(size);
+    if (!g_retro.retro_serialize(buffer->data, size))
+    {
+        g_async_queue_push(g_free_state_buffers, buffer);
+        return;
+    }
 
-    FILE *fp = fopen(save_path, "rb");
-    if (!fp) goto fail;
-    if (fread(state, 1, size, fp) != size) goto fail2;
-    fclose(fp);
+    char *path = string_replace_extension(g_current_game_path, ".resume");
+    fileio_write(path, buffer->data, size, resume_state_written, buffer);
+    free(path);
+}
 
-    bool result = g_retro.retro_unserialize(state, size);
-    free(state);
+bool retrocore_has_resume_state(void)
+{
+    // The resume file might still be being written if the game was just closed.
+    fileio_wait();
 
-    if (result)
+    char *path = string_replace_extension(g_current_game_path, ".resume");
+    bool exists = g_file_test(path, G_FILE_TEST_IS_REGULAR);
+    free(path);
+    return exists;
+}
+
+bool retrocore_resume(void)
+{
+    char *path = string_replace_extension(g_current_game_path, ".resume");
+    GMappedFile *file = g_mapped_file_new(path, FALSE, NULL);
+    bool result = false;
+
+    if (file)
     {
-        // Set loaded SRAM as "current" so that the SRAM on disk won't be overwritten by
-        // an accidental state load.
-        memcpy(last_sram, g_retro.retro_get_memory_data(RETRO_MEMORY_SAVE_RAM), sizeof(last_sram));
+        size_t size = g_retro.retro_serialize_size();
+        result = g_mapped_file_get_length(file) >= size &&
+                 g_retro.retro_unserialize(g_mapped_file_get_contents(file), size);
+        g_mapped_file_unref(file);
     }
 
-    return result;
+    if (result)
+    {
+        // Like any other state, the SRAM in the resume file may be older than the .sav file.
+        sram_mark_saved(g_retro.retro_get_memory_data(RETRO_MEMORY_SAVE_RAM));
 
-fail2:
-    fclose(fp);
-fail:
-    free(state);
-    return false;
+        // Don't go back to the end of the boot sequence.
+        g_boot.skipped = true;
+    }
+    printf("%s %s\n", result ? "Resumed from" : "Failed to resume from", path);
+    free(path);
+    return result;
 }
 
-bool save_state_actual(const char *save_path)
+// Serializes the core's state and hands it to the I/O thread to write out.
+static void save_state_actual(const char *save_path)
 {
     size_t size = g_retro.retro_serialize_size();
-    void *state = malloc(size);
-    if (!g_retro.retro_serialize(state, size)) goto fail;
+    struct state_buffer *buffer = get_state_buffer(size);
+    if (!g_retro.retro_serialize(buffer->data, size))
+    {
+        g_async_queue_push(g_free_state_buffers, buffer);
+        report_state_result(save_path, true, false);
+        return;
+    }
 
-    FILE *fp = fopen(save_path, "wb");
-    if (!fp) goto fail;
-    if (fwrite(state, 1, size, fp) != size) goto fail2;
-    fclose(fp);
+    fileio_write(save_path, buffer->data, size, state_written, buffer);
+}
 
-    printf("Saved state of size %zu to %s\n", size, save_path);
-    free(state);
-    return true;
+static void stop_movie(bool finished);
 
-fail2:
-    fclose(fp);
-fail:
-    free(state);
-    return false;
+// Loads a state read by the I/O thread, if one is waiting.
+static void load_pending_state(void)
+{
+    struct loaded_state *state;
+    while ((state = g_async_queue_try_pop(g_loaded_states)))
+    {
+        if (state->generation == atomic_load(&g_game_generation))
+        {
+            size_t size = g_retro.retro_serialize_size();
+            bool result = state->size >= size && g_retro.retro_unserialize(state->data, size);
+            if (result)
+            {
+                // Set loaded SRAM as "current" so that the SRAM on disk won't be overwritten by
+                // an accidental state load.
+                sram_mark_saved(g_retro.retro_get_memory_data(RETRO_MEMORY_SAVE_RAM));
+
+                // The movie can't continue from a state it doesn't know about.
+                stop_movie(false);
+
+                // Don't let a late boot cache lookup replace the state the player chose.
+                g_boot.skipped = true;
+            }
+            report_state_result(state->path, false, result);
+        }
+
+        g_free(state->data);
+        free(state->path);
+        free(state);
+    }
 }
 
 void retrocore_load_state(const char *path)
 {
-    g_load_state_path = strdup(path);
+    fileio_read(path, state_read, GINT_TO_POINTER(atomic_load(&g_game_generation)));
 }
 
 void retrocore_save_state(const char *path)
@@ -521,11 +939,28 @@ void retrocore_save_state(const char *path)
     g_save_state_path = strdup(path);
 }
 
+void retrocore_shutdown(void)
+{
+    fileio_shutdown();
+}
+
 void retrocore_init(const char *core_path)
 {
-    if (SDL_Init(SDL_INIT_AUDIO | SDL_INIT_JOYSTICK | SDL_INIT_GAMECONTROLLER) < 0)
+    Uint32 subsystems = SDL_INIT_JOYSTICK | SDL_INIT_GAMECONTROLLER;
+    if (g_config.audio_enabled)
+        subsystems |= SDL_INIT_AUDIO;
+    if (SDL_Init(subsystems) < 0)
         die("Failed to initialize SDL");
 
+    if (!g_free_state_buffers)
+    {
+        g_free_state_buffers = g_async_queue_new();
+        g_loaded_states = g_async_queue_new();
+        g_movie_commands = g_async_queue_new();
+    }
+    fileio_init();
+    vfs_init(g_config.vfs_preload);
+
     // Load the core.
     core_load(core_path);
 }
@@ -539,77 +974,686 @@ void retrocore_load_game(const char *game_path)
     // Load the game.
     core_load_game(game_path);
     g_current_game_path = strdup(game_path);
+    atomic_fetch_add(&g_game_generation, 1);
 
     // Load save data (SRAM) from disk.
     char *save_path = string_replace_extension(g_current_game_path, ".sav");
     printf("save path=%s\n", save_path);
-    if (load_sram(save_path))
+    if (sram_open(save_path, g_retro.retro_get_memory_data(RETRO_MEMORY_SAVE_RAM),
+                  g_retro.retro_get_memory_size(RETRO_MEMORY_SAVE_RAM), g_config.sram_flush_delay_ms))
         printf("Loaded SRAM from %s\n", save_path);
     else
         printf("No saved data found\n");
     free(save_path);
-    memcpy(last_sram, g_retro.retro_get_memory_data(RETRO_MEMORY_SAVE_RAM), sizeof(last_sram));
 
     // Configure the player input devices.
     g_retro.retro_set_controller_port_device(0, RETRO_DEVICE_JOYPAD);
+
+    if (g_config.rewind_enabled)
+    {
+        rewind_init(g_retro.retro_serialize_size(), (size_t)g_config.rewind_buffer_mb << 20);
+        last_rewind_capture = 0;
+    }
+
+    // Have a state buffer ready so that the first quick-save doesn't have to allocate one.
+    g_async_queue_push(g_free_state_buffers, get_state_buffer(g_retro.retro_serialize_size()));
+
+    if (g_config.boot_cache_enabled)
+    {
+        g_boot.skipped = false;
+        g_boot.power_on_frame = frame_count;
+        bootcache_open(game_path, BIOS_PATH);
+    }
+
+    g_power_on.size = g_retro.retro_serialize_size();
+    g_power_on.state = malloc(g_power_on.size);
+    if (!g_retro.retro_serialize(g_power_on.state, g_power_on.size))
+    {
+        printf("Failed to save power-on state; resetting will reload the game\n");
+        free(g_power_on.state);
+        g_power_on.state = NULL;
+    }
 }
 
-gpointer retrocore_run_game(gpointer data)
+bool retrocore_reset(void)
 {
-    start_time = 0;
-    running = true;
-    paused = false;
+    if (!g_power_on.state)
+        return false;
 
-    while (running)
+    atomic_store(&g_power_on.requested, true);
+    return true;
+}
+
+// Loads a state without touching the save RAM, for states that aren't tied to
+// the player's save history: the power-on state and boot cache entries.
+static bool unserialize_keeping_sram(const void *state, size_t size)
+{
+    void *sram = g_retro.retro_get_memory_data(RETRO_MEMORY_SAVE_RAM);
+    size_t sram_size = g_retro.retro_get_memory_size(RETRO_MEMORY_SAVE_RAM);
+    void *saved_sram = NULL;
+    if (sram)
+    {
+        saved_sram = malloc(sram_size);
+        memcpy(saved_sram, sram, sram_size);
+    }
+
+    bool result = g_retro.retro_unserialize(state, size);
+
+    if (saved_sram)
     {
-		g_retro.retro_run();
+        memcpy(sram, saved_sram, sram_size);
+        free(saved_sram);
+    }
+    return result;
+}
 
-        // SRAM updated?
-        void *sram = g_retro.retro_get_memory_data(RETRO_MEMORY_SAVE_RAM);
-        if (memcmp(last_sram, sram, sizeof(last_sram)) != 0)
+// Skips the boot sequence once the boot cache lookup is done, or saves the state
+// to the cache when it's time to.
+static void update_boot_cache(void)
+{
+    bool capture = atomic_exchange(&g_boot.capture_requested, false);
+    if (!bootcache_ready())
+    {
+        if (capture)
+            printf("Boot cache isn't ready yet\n");
+        return;
+    }
+
+    const void *state;
+    size_t size;
+    int64_t frame;
+    int64_t frames_since_power_on = frame_count - g_boot.power_on_frame;
+    bool cached = bootcache_get(&state, &size, &frame);
+    if (cached && !g_boot.skipped)
+    {
+        // If the lookup took so long that the game has gone past the cached
+        // state, the player may already be playing, so leave it alone.
+        // The cached state's save RAM could be from any save history, so keep the player's.
+        if (frames_since_power_on <= frame && size == g_retro.retro_serialize_size() &&
+            unserialize_keeping_sram(state, size))
         {
-            printf("SRAM updated!\n");
-            char *save_path = string_replace_extension(g_current_game_path, ".sav");
-            if (save_sram(save_path))
-                printf("Saved SRAM to %s\n", save_path);
-            else
-                printf("Failed to save SRAM to %s\n", save_path);
-            free(save_path);
-            memcpy(last_sram, sram, sizeof(last_sram));
+            printf("Skipped boot sequence using cached state from frame %lld\n", (long long) frame);
+            sram_mark_saved(g_retro.retro_get_memory_data(RETRO_MEMORY_SAVE_RAM));
         }
+        g_boot.skipped = true;
+    }
+
+    if (!cached && g_config.boot_cache_frame && frames_since_power_on == g_config.boot_cache_frame)
+        capture = true;
+
+    if (capture)
+    {
+        size = g_retro.retro_serialize_size();
+        void *data = malloc(size);
+        if (g_retro.retro_serialize(data, size) && bootcache_store(data, size, frames_since_power_on))
+            g_boot.skipped = true;
+        else
+            printf("Failed to save boot cache entry\n");
+        free(data);
+    }
+}
+
+// Goes back to the power-on state, keeping the current save RAM like a real power cycle would.
+static void reset_to_power_on(void)
+{
+    if (unserialize_keeping_sram(g_power_on.state, g_power_on.size))
+    {
+        printf("Reset\n");
+        g_boot.skipped = false;
+        g_boot.power_on_frame = frame_count;
+    }
+    else
+        printf("Failed to reset\n");
+}
+
+// Goes back one step in the rewind history. Returns false if there's nothing to go back to.
+static bool rewind_step(void)
+{
+    const void *state = rewind_pop();
+    if (!state || !g_retro.retro_unserialize(state, g_retro.retro_serialize_size()))
+        return false;
+
+    // Don't let rewinding overwrite the SRAM on disk with an older copy.
+    sram_mark_saved(g_retro.retro_get_memory_data(RETRO_MEMORY_SAVE_RAM));
+    g_boot.skipped = true;
+    return true;
+}
 
-        if (g_save_state_path)
+// Captures a state for rewinding if one is due and the last one is done compressing.
+static void rewind_capture(void)
+{
+    if (frame_count - last_rewind_capture < g_config.rewind_interval)
+        return;
+
+    void *state = rewind_capture_buffer();
+    if (state && g_retro.retro_serialize(state, g_retro.retro_serialize_size()))
+    {
+        rewind_push();
+        last_rewind_capture = frame_count;
+    }
+}
+
+static void run_core(int outputs)
+{
+    av_enable = outputs;
+    g_retro.retro_run();
+    av_enable = AV_ENABLE_VIDEO | AV_ENABLE_AUDIO;
+}
+
+void retrocore_set_movie_callback(retrocore_movie_callback callback)
+{
+    g_movie_callback = callback;
+}
+
+static void report_movie_event(const char *path, enum retrocore_movie_event event)
+{
+    static const char *const messages[] = {
+        [RETROCORE_MOVIE_RECORDING] = "Recording movie to",
+        [RETROCORE_MOVIE_PLAYING] = "Playing movie",
+        [RETROCORE_MOVIE_SAVED] = "Stopped recording movie to",
+        [RETROCORE_MOVIE_STOPPED] = "Stopped playing movie",
+        [RETROCORE_MOVIE_FINISHED] = "Finished playing movie",
+        [RETROCORE_MOVIE_FAILED] = "Failed to start movie",
+    };
+    printf("%s %s\n", messages[event], path);
+    if (g_movie_callback)
+        g_movie_callback(path, event);
+}
+
+static void queue_movie_command(enum movie_command_type type, const char *path, int64_t frame)
+{
+    struct movie_command *command = malloc(sizeof(*command));
+    command->type = type;
+    command->path = path ? strdup(path) : NULL;
+    command->frame = frame;
+    g_async_queue_push(g_movie_commands, command);
+}
+
+void retrocore_record_movie(const char *path, bool from_power_on)
+{
+    queue_movie_command(from_power_on ? MOVIE_COMMAND_RECORD_FROM_POWER_ON : MOVIE_COMMAND_RECORD, path, 0);
+}
+
+void retrocore_play_movie(const char *path)
+{
+    queue_movie_command(MOVIE_COMMAND_PLAY, path, 0);
+}
+
+void retrocore_stop_movie(void)
+{
+    queue_movie_command(MOVIE_COMMAND_STOP, NULL, 0);
+}
+
+void retrocore_seek_movie(int64_t frame)
+{
+    queue_movie_command(MOVIE_COMMAND_SEEK, NULL, frame);
+}
+
+// Stops recording or playback, if a movie is active. finished means that the
+// end of the movie being played was reached.
+static void stop_movie(bool finished)
+{
+    enum movie_state state = movie_state();
+    if (state == MOVIE_NONE)
+        return;
+
+    enum retrocore_movie_event event = finished ? RETROCORE_MOVIE_FINISHED :
+        state == MOVIE_RECORDING ? RETROCORE_MOVIE_SAVED : RETROCORE_MOVIE_STOPPED;
+    movie_stop();
+    report_movie_event(g_movie_path, event);
+    free(g_movie_path);
+    g_movie_path = NULL;
+}
+
+static void start_recording(const char *path, bool from_power_on)
+{
+    stop_movie(false);
+    if (from_power_on)
+    {
+        if (!g_power_on.state)
         {
-            save_state_actual(g_save_state_path);
-            free(g_save_state_path);
-            g_save_state_path = NULL;
+            report_movie_event(path, RETROCORE_MOVIE_FAILED);
+            return;
         }
+        reset_to_power_on();
+    }
+
+    size_t size = g_retro.retro_serialize_size();
+    void *state = malloc(size);
+    if (!g_retro.retro_serialize(state, size))
+    {
+        free(state);
+        report_movie_event(path, RETROCORE_MOVIE_FAILED);
+        return;
+    }
 
-        if (g_load_state_path)
+    movie_record(path, state, size, g_retro.retro_get_memory_data(RETRO_MEMORY_SAVE_RAM),
+                 g_retro.retro_get_memory_size(RETRO_MEMORY_SAVE_RAM), g_config.movie_keyframe_interval);
+    free(state);
+    g_movie_path = strdup(path);
+    report_movie_event(path, RETROCORE_MOVIE_RECORDING);
+}
+
+static void start_playback(const char *path)
+{
+    stop_movie(false);
+
+    size_t size = g_retro.retro_serialize_size();
+    if (!movie_play(path, size) || !g_retro.retro_unserialize(movie_start_state(), size))
+    {
+        movie_stop();
+        report_movie_event(path, RETROCORE_MOVIE_FAILED);
+        return;
+    }
+
+    // The game may depend on what's in save RAM, so play it back with what was
+    // there when the movie was recorded. Like any other state, this isn't
+    // written to the save file unless the game changes it.
+    size_t sram_size;
+    const void *sram = movie_start_sram(&sram_size);
+    void *core_sram = g_retro.retro_get_memory_data(RETRO_MEMORY_SAVE_RAM);
+    if (core_sram && sram_size == g_retro.retro_get_memory_size(RETRO_MEMORY_SAVE_RAM))
+        memcpy(core_sram, sram, sram_size);
+    sram_mark_saved(core_sram);
+
+    // The movie already covers the boot sequence.
+    g_boot.skipped = true;
+
+    g_movie_path = strdup(path);
+    report_movie_event(path, RETROCORE_MOVIE_PLAYING);
+}
+
+// Loads the keyframe before the given frame, then runs the frames in between
+// without any output.
+static void seek_movie(int64_t frame)
+{
+    const void *state = movie_seek(frame);
+    if (!state || !g_retro.retro_unserialize(state, g_retro.retro_serialize_size()))
+    {
+        printf("Failed to seek to frame %lld\n", (long long) frame);
+        return;
+    }
+
+    while (movie_position() < frame && movie_next_input(&g_input))
+        run_core(0);
+    sram_mark_saved(g_retro.retro_get_memory_data(RETRO_MEMORY_SAVE_RAM));
+}
+
+static void process_movie_commands(void)
+{
+    struct movie_command *command;
+    while ((command = g_async_queue_try_pop(g_movie_commands)))
+    {
+        switch (command->type)
         {
-            load_state_actual(g_load_state_path);
-            free(g_load_state_path);
-            g_load_state_path = NULL;
+            case MOVIE_COMMAND_RECORD:
+            case MOVIE_COMMAND_RECORD_FROM_POWER_ON:
+                start_recording(command->path, command->type == MOVIE_COMMAND_RECORD_FROM_POWER_ON);
+                break;
+            case MOVIE_COMMAND_PLAY:
+                start_playback(command->path);
+                break;
+            case MOVIE_COMMAND_STOP:
+                stop_movie(false);
+                break;
+            case MOVIE_COMMAND_SEEK:
+                if (movie_state() == MOVIE_PLAYING)
+                    seek_movie(command->frame);
+                break;
         }
+        free(command->path);
+        free(command);
+    }
+}
 
-		++frame_count;
-	}
+// Sets g_input for the frame about to run, from the movie being played or from
+// the keyboard, and records it if a movie is being recorded.
+static void latch_input(void)
+{
+    if (movie_state() == MOVIE_PLAYING)
+    {
+        if (movie_next_input(&g_input))
+            return;
+        stop_movie(true);
+    }
+
+    uint16_t input = 0;
+    for (int i = 0; i <= RETRO_DEVICE_ID_JOYPAD_R3; i++)
+    {
+        if (g_joy[i])
+            input |= 1 << i;
+    }
+    g_input = input;
+
+    if (movie_state() == MOVIE_RECORDING)
+    {
+        void *keyframe = movie_keyframe_buffer();
+        if (keyframe && g_retro.retro_serialize(keyframe, g_retro.retro_serialize_size()))
+            movie_add_keyframe();
+        movie_record_input(input);
+    }
+}
+
+// Starts or stops fast-forwarding if requested. Returns true while fast-forwarding.
+static bool update_fast_forward(void)
+{
+    bool requested = atomic_load(&g_fast_forward.requested) || g_auto_turbo.engaged;
+    if (requested == g_fast_forward.active)
+        return requested;
+
+    g_fast_forward.active = requested;
+    g_fast_forward.next_video_time = 0;
+    set_speed(requested ? g_config.fast_forward_speed : 1.0);
+
+    // The audio is skipped while fast-forwarding, so don't count that as underruns.
+    if (g_audio_open && !paused)
+        audio_pause(requested);
+    return requested;
+}
+
+static void run_fast_forward_frame(void)
+{
+    if (g_config.frame_pacing)
+        wait_while_paused();
+
+    // Only render as many frames as the display can show.
+    double now = retrocore_time();
+    bool show = now >= g_fast_forward.next_video_time;
+    if (show)
+        g_fast_forward.next_video_time = now + target_frame_time;
+
+    int outputs = show ? AV_ENABLE_VIDEO : 0;
+    if (g_auto_turbo.engaged)
+        outputs |= AV_ENABLE_AUDIO;
+    run_core(outputs);
+
+    // Frames without video don't wait in video_refresh, so pace them here.
+    if (!show && g_config.frame_pacing && g_clock.speed != 0)
+        wait_until(frame_presentation_time());
+}
+
+// Runs the real frame with audio only, then runs the given number of frames
+// past it and displays the last one, so that the game's internal input lag is
+// hidden. Afterwards the state of the real frame is restored.
+static void run_ahead(unsigned frames)
+{
+    size_t size = g_retro.retro_serialize_size();
+    if (size != g_runahead.state_size)
+    {
+        g_runahead.state = realloc(g_runahead.state, size);
+        g_runahead.state_size = size;
+
+        // Make sure the core can save its state before running a frame without
+        // video, or that frame would never be shown.
+        if (!size || !g_retro.retro_serialize(g_runahead.state, size))
+        {
+            printf("Core can't save state; disabling run-ahead\n");
+            g_config.runahead_frames = 0;
+            run_core(AV_ENABLE_VIDEO | AV_ENABLE_AUDIO);
+            return;
+        }
+    }
+
+    run_core(AV_ENABLE_AUDIO);
+
+    Uint64 start = SDL_GetPerformanceCounter();
+    Uint64 wait_start = pacing_wait_ticks;
+    if (!g_retro.retro_serialize(g_runahead.state, size))
+    {
+        // Too late to render this frame; the last one stays on screen.
+        printf("Core can't save state; disabling run-ahead\n");
+        g_config.runahead_frames = 0;
+        return;
+    }
+    for (unsigned i = 1; i < frames; i++)
+        run_core(0);
+    run_core(AV_ENABLE_VIDEO);
+    g_retro.retro_unserialize(g_runahead.state, size);
+
+    // Don't count the time spent waiting to display the frame as overhead.
+    g_runahead.extra_ticks += SDL_GetPerformanceCounter() - start - (pacing_wait_ticks - wait_start);
+    g_runahead.frames++;
+    g_stats.runahead_time = (double)g_runahead.extra_ticks / g_runahead.frames / SDL_GetPerformanceFrequency();
+    if (g_runahead.frames == 600)
+    {
+        printf("run-ahead: %u frames, %.3f ms extra per frame\n", frames, g_stats.runahead_time * 1000);
+        g_runahead.extra_ticks = 0;
+        g_runahead.frames = 0;
+    }
+}
+
+// Decides from what happened during the last frame whether it's a loading screen.
+static void update_auto_turbo(void)
+{
+    uint64_t bytes_read = vfs_total_bytes_read();
+    if (bytes_read != g_auto_turbo.bytes_read)
+    {
+        g_auto_turbo.bytes_read = bytes_read;
+        g_auto_turbo.last_read_frame = frame_count;
+    }
+
+    bool idle = !g_auto_turbo.video_changed && !g_auto_turbo.audio_active && !g_auto_turbo.input_active;
+    g_auto_turbo.idle_frames = idle ? g_auto_turbo.idle_frames + 1 : 0;
+    g_auto_turbo.video_changed = false;
+    g_auto_turbo.audio_active = false;
+    g_auto_turbo.input_active = false;
+
+    bool loading = g_auto_turbo.idle_frames >= AUTO_TURBO_IDLE_FRAMES &&
+                   frame_count - g_auto_turbo.last_read_frame < AUTO_TURBO_READ_WINDOW;
+    if (loading != g_auto_turbo.engaged)
+        printf("Auto-turbo %s at frame %lld\n", loading ? "on" : "off", (long long) frame_count);
+    g_auto_turbo.engaged = loading;
+}
+
+// Decides whether to skip rendering the next frame.
+static bool should_skip_frame(void)
+{
+    if (!g_config.frameskip_enabled || !g_config.frame_pacing || !g_config.video_enabled)
+        return false;
+
+    // Show a frame every now and then, however far behind the emulator is.
+    if (g_frameskip.consecutive >= g_config.frameskip_max)
+        return false;
+
+    // Skip if rendering the frame would make it more than a frame late.
+    return retrocore_time() + g_frameskip.render_cost > frame_presentation_time() + target_frame_time;
+}
+
+static void update_frameskip_stats(bool skipped, Uint64 ticks)
+{
+    if (skipped)
+    {
+        g_frameskip.consecutive++;
+        g_frameskip.skipped++;
+    }
+    else
+    {
+        double cost = (double)ticks / SDL_GetPerformanceFrequency();
+        g_frameskip.render_cost += (cost - g_frameskip.render_cost) * 0.1;
+        g_frameskip.consecutive = 0;
+    }
+
+    if (++g_frameskip.frames == 600)
+    {
+        g_stats.frameskip_rate = (double)g_frameskip.skipped / g_frameskip.frames;
+        if (g_frameskip.skipped)
+            printf("frameskip: skipped %u of %u frames\n", g_frameskip.skipped, g_frameskip.frames);
+        g_frameskip.skipped = 0;
+        g_frameskip.frames = 0;
+    }
+}
+
+void retrocore_set_hash_callback(retrocore_hash_callback callback)
+{
+    g_hash.callback = callback;
+}
+
+static void report_frame_hash(void)
+{
+    struct retrocore_frame_hash hash = {0};
+    hash.frame = frame_count;
+    hash.has_video = g_hash.has_video;
+    if (g_hash.has_video)
+    {
+        hash.video = g_hash.video;
+        hash.width = g_hash.width;
+        hash.height = g_hash.height;
+    }
+    hash.audio = hash_buffer(g_hash.audio, g_hash.audio_frames * 2 * sizeof(int16_t));
+    hash.audio_frames = g_hash.audio_frames;
+    g_hash.callback(&hash);
+
+    g_hash.has_video = false;
+    g_hash.audio_frames = 0;
+}
+
+// Runs a single frame of emulation, then handles any pending SRAM writes and state requests.
+void retrocore_run_frame(void)
+{
+    Uint64 start = SDL_GetPerformanceCounter();
+    Uint64 wait_start = pacing_wait_ticks;
+
+    if (atomic_exchange(&g_power_on.requested, false))
+    {
+        stop_movie(false);
+        reset_to_power_on();
+    }
+
+    process_movie_commands();
+
+    // Skipping to a cached state or rewinding would make the movie useless.
+    bool movie_active = movie_state() != MOVIE_NONE;
+    if (g_config.boot_cache_enabled && !movie_active)
+        update_boot_cache();
+
+    bool rewinding = g_config.rewind_enabled && g_rewind_held && !movie_active && rewind_step();
+    if (!rewinding)
+        latch_input();
+    bool fast_forwarding = update_fast_forward() && !rewinding;
+    bool skipping = !rewinding && !fast_forwarding && should_skip_frame();
+
+    if (rewinding)
+        run_core(AV_ENABLE_VIDEO); // don't play the audio backwards; it sounds awful
+    else if (fast_forwarding)
+        run_fast_forward_frame();
+    else if (skipping)
+        run_core(AV_ENABLE_AUDIO); // no point running ahead for a frame that isn't shown
+    else if (g_config.runahead_frames)
+        run_ahead(g_config.runahead_frames);
+    else
+        run_core(AV_ENABLE_VIDEO | AV_ENABLE_AUDIO);
+
+    // Write out all of the frame's audio at once.
+    if (g_audio_open)
+        audio_flush();
+
+    if (g_hash.callback)
+        report_frame_hash();
+
+    // SRAM updated? It's written out in the background.
+    sram_check(g_retro.retro_get_memory_data(RETRO_MEMORY_SAVE_RAM));
+
+    if (g_save_state_path)
+    {
+        save_state_actual(g_save_state_path);
+        free(g_save_state_path);
+        g_save_state_path = NULL;
+    }
+
+    load_pending_state();
+
+    if (g_config.rewind_enabled)
+    {
+        if (!rewinding)
+            rewind_capture();
+        rewind_work(REWIND_BUDGET);
+    }
+
+    if (g_audio_open)
+        audio_get_stats(&g_stats.audio_underruns, &g_stats.audio_overruns);
+    g_stats.vfs_max_read_time = MAX(g_stats.vfs_max_read_time, vfs_take_max_read_time());
+
+    if (g_config.auto_turbo && !rewinding)
+        update_auto_turbo();
+
+    // Don't count the time spent waiting to display the frame.
+    if (!rewinding && !fast_forwarding)
+        update_frameskip_stats(skipping, SDL_GetPerformanceCounter() - start - (pacing_wait_ticks - wait_start));
+
+    ++frame_count;
+}
+
+gpointer retrocore_run_game(gpointer data)
+{
+    start_time = 0;
+    running = true;
+    paused = false;
+
+    while (running)
+    {
+        retrocore_run_frame();
+    }
 
     // The game is being closed, so unload everything.
+    retrocore_unload_game();
+
+    return NULL;
+}
+
+void retrocore_unload_game(void)
+{
+    // Pick up anything saved on the last frame and write it out before the core goes away.
+    if (g_retro.initialized)
+    {
+        stop_movie(false);
+        sram_check(g_retro.retro_get_memory_data(RETRO_MEMORY_SAVE_RAM));
+        if (g_config.resume_enabled)
+            save_resume_state();
+    }
+    sram_close();
+
     core_unload();
 	audio_deinit();
+    g_audio_open = false;
 	video_deinit();
+    rewind_deinit();
+    free(g_runahead.state);
+    memset(&g_runahead, 0, sizeof(g_runahead));
+    free(g_power_on.state);
+    g_power_on.state = NULL;
+    bootcache_close();
+    atomic_store(&g_power_on.requested, false);
+    memset(&g_stats, 0, sizeof(g_stats));
 
     free(g_current_game_path);
     g_current_game_path = NULL;
     frame_count = 0;
-    memset(last_sram, 0, sizeof(last_sram));
-
-    return NULL;
+    g_clock.frame = 0;
+    g_clock.time = 0;
+    g_clock.speed = 1;
+    g_fast_forward.active = false;
+    atomic_store(&g_fast_forward.requested, false);
+    memset(&g_frameskip, 0, sizeof(g_frameskip));
+    memset(&g_auto_turbo, 0, sizeof(g_auto_turbo));
+    g_input = 0;
+    g_hash.has_video = false;
+    g_hash.video = 0;
+    g_hash.audio_frames = 0;
+
+    // Drop any movie commands meant for this game.
+    struct movie_command *command;
+    while (g_movie_commands && (command = g_async_queue_try_pop(g_movie_commands)))
+    {
+        free(command->path);
+        free(command);
+    }
 }
 
 void retrocore_close_game()
 {
+    g_mutex_lock(&g_pace_lock);
     running = false;
+    g_cond_signal(&g_pace_cond);
+    g_mutex_unlock(&g_pace_lock);
 }
 
@@ -13,17 +13,28 @@ struct video_frame {
     double presentation_time;
 };
 
-// Used to signal when the frontend has displayed a frame and is ready for a new one.
-extern GMutex g_frame_lock;
-extern GCond g_ready_cond;
-
 // Path to the current ROM or disc image, or NULL if nothing is loaded.
 extern char *g_current_game_path;
 
-extern struct video_frame g_frames[];
-extern int g_next_frame;
+// Performance measurements, updated periodically by the emulator thread.
+struct retrocore_stats {
+    double runahead_time; // mean extra CPU time per frame spent on run-ahead, in seconds
+    uint64_t audio_underruns; // times the audio device ran out of samples
+    uint64_t audio_overruns;  // times samples were dropped because the buffer was full
+    double vfs_max_read_time; // longest single file read by the core, in seconds
+    double frameskip_rate;    // fraction of frames not rendered to keep up with real time
+};
+
+extern struct retrocore_stats g_stats;
 extern double target_frame_time;
 
+// Returns the most recent frame finished by the emulator thread. The frame stays
+// valid until the next call. Only call this from the GUI thread.
+struct video_frame *retrocore_get_frame(void);
+
+// Gets the largest frame size the core can output. All frame buffers are this size.
+void retrocore_get_max_frame_size(unsigned *width, unsigned *height);
+
 // returns time from core startup in seconds
 double retrocore_time(void);
 
@@ -31,15 +42,83 @@ void retrocore_pause(void);
 void retrocore_unpause(void);
 void retrocore_toggle_pause(void);
 
+// Runs the game faster than real time (see fast_forward_speed in config.h), with
+// only as many frames rendered as the display can show and no audio.
+void retrocore_set_fast_forward(bool enabled);
+
+// Resets the game to its power-on state at the start of the next frame. Returns
+// false if the core couldn't save its power-on state, in which case the game has
+// to be reloaded instead.
+bool retrocore_reset(void);
+
+// Called when a save state has been written or loaded. This can be called from
+// any thread.
+typedef void (*retrocore_state_callback)(const char *path, bool save, bool success);
+void retrocore_set_state_callback(retrocore_state_callback callback);
+
+// When resuming is enabled, the state is saved when a game is closed. These check
+// for and load that state; call them after retrocore_load_game, before running
+// any frames.
+bool retrocore_has_resume_state(void);
+bool retrocore_resume(void);
+
+// Both of these return immediately; the file is read or written in the background.
 void retrocore_load_state(const char *path);
 void retrocore_save_state(const char *path);
 
+// Input movies (see movie.h). These take effect at the start of the next frame.
+// Recording starts from the current frame, or from power-on if from_power_on is
+// set, and playing a movie loads the state it starts from. Loading a state,
+// resetting or closing the game stops recording or playback.
+void retrocore_record_movie(const char *path, bool from_power_on);
+void retrocore_play_movie(const char *path);
+void retrocore_stop_movie(void);
+
+// Jumps to the given frame of the movie being played.
+void retrocore_seek_movie(int64_t frame);
+
+enum retrocore_movie_event {
+    RETROCORE_MOVIE_RECORDING, // recording started
+    RETROCORE_MOVIE_PLAYING,   // playback started
+    RETROCORE_MOVIE_SAVED,     // recording stopped; the movie is written in the background
+    RETROCORE_MOVIE_STOPPED,   // playback stopped before the end
+    RETROCORE_MOVIE_FINISHED,  // playback reached the end of the movie
+    RETROCORE_MOVIE_FAILED,    // the movie couldn't be recorded or played
+};
+
+// Hashes of what the core output for one frame, for checking that two runs are
+// identical. Only the frame and audio that are actually used are hashed, so
+// fast-forward and run-ahead change the results.
+struct retrocore_frame_hash {
+    int64_t frame;
+    bool has_video;      // false if video wasn't rendered for this frame
+    uint64_t video;      // hash of the picture shown; a dupe has the last frame's hash
+    unsigned width;
+    unsigned height;
+    uint64_t audio;      // hash of the frame's samples
+    size_t audio_frames; // number of stereo samples
+};
+
+// When set, every frame's output is hashed and passed to this at the end of
+// the frame, on the emulator thread.
+typedef void (*retrocore_hash_callback)(const struct retrocore_frame_hash *hash);
+void retrocore_set_hash_callback(retrocore_hash_callback callback);
+
+// Called from the emulator thread when a movie starts or stops.
+typedef void (*retrocore_movie_callback)(const char *path, enum retrocore_movie_event event);
+void retrocore_set_movie_callback(retrocore_movie_callback callback);
+
 void handle_key_event(unsigned keyval, bool pressed);
 
 void retrocore_init(const char *core_path);
 void retrocore_load_game(const char *game_path);
+void retrocore_run_frame(void);
 gpointer retrocore_run_game(gpointer data);
 void retrocore_close_game();
+void retrocore_unload_game(void);
+
+// Finishes writing any pending files. Call before exiting.
+void retrocore_shutdown(void);
 
 #endif
 
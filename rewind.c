@@ -0,0 +1,302 @@
+/*
+ * Copyright (c) 2020 Bryan Cain
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <glib.h>
+#include "rewind.h"
+
+#define MAX_SNAPSHOTS 65536
+
+// A run of unchanged bytes shorter than this is stored as part of a literal
+// run, since splitting the literal would cost more than it saves.
+#define MIN_ZERO_RUN 4
+
+// How many input bytes to compress between checks of the time budget.
+#define WORK_CHUNK 16384
+
+struct snapshot {
+    size_t offset;
+    size_t size;
+};
+
+static struct {
+    size_t state_size;
+    uint8_t *current; // most recent state, uncompressed
+    uint8_t *next;    // state being captured or compressed
+    bool have_current;
+    bool current_popped;
+
+    // compressed deltas; snapshots[first] is the oldest
+    uint8_t *buffer;
+    size_t buffer_size;
+    struct snapshot *snapshots;
+    int first, count;
+
+    // compression of "next" against "current" in progress
+    bool compressing;
+    uint8_t *scratch;
+    size_t in_pos, out_pos;
+} g_rewind = {0};
+
+void rewind_init(size_t state_size, size_t buffer_size)
+{
+    rewind_deinit();
+
+    g_rewind.state_size = state_size;
+    g_rewind.current = malloc(state_size);
+    g_rewind.next = malloc(state_size);
+    g_rewind.buffer = malloc(buffer_size);
+    g_rewind.buffer_size = buffer_size;
+    g_rewind.snapshots = malloc(MAX_SNAPSHOTS * sizeof(struct snapshot));
+    // Worst case: every literal run is interrupted by a minimum length zero run.
+    g_rewind.scratch = malloc(state_size + state_size / MIN_ZERO_RUN * 2 + 16);
+
+    printf("Rewind enabled: %zu byte states, %zu MB buffer\n", state_size, buffer_size >> 20);
+}
+
+void rewind_deinit(void)
+{
+    free(g_rewind.current);
+    free(g_rewind.next);
+    free(g_rewind.buffer);
+    free(g_rewind.snapshots);
+    free(g_rewind.scratch);
+    memset(&g_rewind, 0, sizeof(g_rewind));
+}
+
+static struct snapshot *oldest(void)
+{
+    return &g_rewind.snapshots[g_rewind.first];
+}
+
+static struct snapshot *newest(void)
+{
+    return &g_rewind.snapshots[(g_rewind.first + g_rewind.count - 1) % MAX_SNAPSHOTS];
+}
+
+static void drop_oldest(void)
+{
+    g_rewind.first = (g_rewind.first + 1) % MAX_SNAPSHOTS;
+    --g_rewind.count;
+}
+
+// Finds space for a snapshot of the given size in the ring buffer, discarding
+// the oldest snapshots as needed. Returns false if it can't ever fit.
+static bool allocate_snapshot(size_t size, size_t *offset_out)
+{
+    if (size > g_rewind.buffer_size)
+    {
+        g_rewind.count = 0;
+        return false;
+    }
+
+    if (g_rewind.count == MAX_SNAPSHOTS)
+        drop_oldest();
+
+    size_t offset = 0;
+    if (g_rewind.count)
+        offset = newest()->offset + newest()->size;
+
+    if (offset + size > g_rewind.buffer_size)
+    {
+        // Wrap around to the start of the buffer. Any snapshots past the end of
+        // the newest one are the oldest, and they're in the way now.
+        while (g_rewind.count && oldest()->offset >= offset)
+            drop_oldest();
+        offset = 0;
+    }
+
+    while (g_rewind.count && oldest()->offset < offset + size &&
+           oldest()->offset + oldest()->size > offset)
+    {
+        drop_oldest();
+    }
+
+    *offset_out = offset;
+    return true;
+}
+
+static size_t write_varint(uint8_t *out, size_t value)
+{
+    size_t len = 0;
+    while (value >= 0x80)
+    {
+        out[len++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    out[len++] = value;
+    return len;
+}
+
+static size_t read_varint(const uint8_t *in, size_t *value)
+{
+    size_t len = 0, shift = 0;
+    *value = 0;
+    do {
+        *value |= (size_t)(in[len] & 0x7f) << shift;
+        shift += 7;
+    } while (in[len++] & 0x80);
+    return len;
+}
+
+// Returns the position of the first differing byte at or after pos.
+static size_t skip_equal(const uint8_t *a, const uint8_t *b, size_t pos, size_t end)
+{
+    while (pos + 8 <= end)
+    {
+        uint64_t x, y;
+        memcpy(&x, a + pos, 8);
+        memcpy(&y, b + pos, 8);
+        if (x != y)
+            break;
+        pos += 8;
+    }
+    while (pos < end && a[pos] == b[pos])
+        ++pos;
+    return pos;
+}
+
+// Encodes one (zero run, literal run) pair of the delta between next and current.
+static void compress_token(void)
+{
+    const uint8_t *cur = g_rewind.current, *next = g_rewind.next;
+    size_t end = g_rewind.state_size;
+    size_t zero_start = g_rewind.in_pos;
+    size_t literal_start = skip_equal(cur, next, zero_start, end);
+    size_t pos = literal_start;
+
+    while (pos < end)
+    {
+        if (cur[pos] != next[pos])
+        {
+            ++pos;
+            continue;
+        }
+        size_t equal_end = skip_equal(cur, next, pos, MIN(pos + MIN_ZERO_RUN, end));
+        if (equal_end - pos >= MIN_ZERO_RUN || equal_end == end)
+            break;
+        pos = equal_end;
+    }
+
+    uint8_t *out = g_rewind.scratch + g_rewind.out_pos;
+    out += write_varint(out, literal_start - zero_start);
+    out += write_varint(out, pos - literal_start);
+    for (size_t i = literal_start; i < pos; i++)
+        *out++ = cur[i] ^ next[i];
+
+    g_rewind.out_pos = out - g_rewind.scratch;
+    g_rewind.in_pos = pos;
+}
+
+// Makes the captured state the current one, storing the compressed delta.
+static void finish_push(void)
+{
+    size_t offset;
+    if (g_rewind.have_current && allocate_snapshot(g_rewind.out_pos, &offset))
+    {
+        memcpy(g_rewind.buffer + offset, g_rewind.scratch, g_rewind.out_pos);
+        g_rewind.count++;
+        *newest() = (struct snapshot) { offset, g_rewind.out_pos };
+    }
+
+    uint8_t *tmp = g_rewind.current;
+    g_rewind.current = g_rewind.next;
+    g_rewind.next = tmp;
+    g_rewind.have_current = true;
+    g_rewind.current_popped = false;
+    g_rewind.compressing = false;
+}
+
+void *rewind_capture_buffer(void)
+{
+    if (g_rewind.compressing)
+        return NULL;
+    return g_rewind.next;
+}
+
+void rewind_push(void)
+{
+    if (!g_rewind.have_current)
+    {
+        finish_push();
+        return;
+    }
+
+    g_rewind.compressing = true;
+    g_rewind.in_pos = 0;
+    g_rewind.out_pos = 0;
+}
+
+void rewind_work(double budget)
+{
+    if (!g_rewind.compressing)
+        return;
+
+    gint64 deadline = g_get_monotonic_time() + (gint64)(budget * G_USEC_PER_SEC);
+    size_t chunk_end = g_rewind.in_pos + WORK_CHUNK;
+    while (g_rewind.in_pos < g_rewind.state_size)
+    {
+        compress_token();
+        if (g_rewind.in_pos >= chunk_end)
+        {
+            if (g_get_monotonic_time() >= deadline)
+                return;
+            chunk_end = g_rewind.in_pos + WORK_CHUNK;
+        }
+    }
+
+    finish_push();
+}
+
+// Turns the current state into the one before it by applying the newest delta.
+static void apply_newest_delta(void)
+{
+    const uint8_t *in = g_rewind.buffer + newest()->offset;
+    const uint8_t *in_end = in + newest()->size;
+    uint8_t *state = g_rewind.current;
+    size_t pos = 0;
+
+    while (in < in_end)
+    {
+        size_t zeros, literals;
+        in += read_varint(in, &zeros);
+        in += read_varint(in, &literals);
+        pos += zeros;
+        for (size_t i = 0; i < literals; i++)
+            state[pos++] ^= *in++;
+    }
+
+    --g_rewind.count;
+}
+
+const void *rewind_pop(void)
+{
+    if (!g_rewind.have_current)
+        return NULL;
+
+    // Anything captured after the state we're going back to is now useless.
+    g_rewind.compressing = false;
+
+    if (g_rewind.current_popped && g_rewind.count)
+        apply_newest_delta();
+    g_rewind.current_popped = true;
+
+    return g_rewind.current;
+}
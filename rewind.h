@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2020 Bryan Cain
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Ring buffer of save states for rewinding. Only the most recent state is kept
+// uncompressed; older states are stored as the XOR of each state with the one
+// before it, run-length encoded, which is usually only a few KB per state.
+// All of these functions must be called from the emulator thread.
+
+// buffer_size is the maximum number of bytes used for compressed states.
+void rewind_init(size_t state_size, size_t buffer_size);
+void rewind_deinit(void);
+
+// Returns a buffer to serialize a new state into, or NULL if the previous state
+// is still being compressed.
+void *rewind_capture_buffer(void);
+
+// Adds the state written to the capture buffer to the rewind history. The
+// compression is done incrementally by rewind_work().
+void rewind_push(void);
+
+// Compresses the pending state for up to budget seconds. Call once per frame.
+void rewind_work(double budget);
+
+// Returns the next state going backwards in time, or NULL if there are none.
+// The returned pointer is valid until the next call to any rewind function.
+const void *rewind_pop(void);
+
+#endif
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2020 Bryan Cain
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "ringbuffer.h"
+
+// The read and write positions increase forever (until they wrap around
+// SIZE_MAX, which works out fine with unsigned arithmetic) and are masked
+// to get an offset in the buffer.
+
+void ringbuffer_init(struct ringbuffer *rb, size_t size)
+{
+    size_t real_size = 1;
+    while (real_size < size)
+        real_size <<= 1;
+
+    rb->data = malloc(real_size);
+    rb->size = real_size;
+    atomic_init(&rb->write_pos, 0);
+    atomic_init(&rb->read_pos, 0);
+}
+
+void ringbuffer_free(struct ringbuffer *rb)
+{
+    free(rb->data);
+    rb->data = NULL;
+    rb->size = 0;
+}
+
+size_t ringbuffer_used(struct ringbuffer *rb)
+{
+    return atomic_load_explicit(&rb->write_pos, memory_order_acquire) -
+           atomic_load_explicit(&rb->read_pos, memory_order_acquire);
+}
+
+size_t ringbuffer_write(struct ringbuffer *rb, const void *data, size_t len)
+{
+    size_t write_pos = atomic_load_explicit(&rb->write_pos, memory_order_relaxed);
+    size_t read_pos = atomic_load_explicit(&rb->read_pos, memory_order_acquire);
+    size_t space = rb->size - (write_pos - read_pos);
+    if (len > space)
+        len = space;
+
+    size_t offset = write_pos & (rb->size - 1);
+    size_t first = rb->size - offset;
+    if (first > len)
+        first = len;
+    memcpy(rb->data + offset, data, first);
+    memcpy(rb->data, (const uint8_t *) data + first, len - first);
+
+    atomic_store_explicit(&rb->write_pos, write_pos + len, memory_order_release);
+    return len;
+}
+
+size_t ringbuffer_read(struct ringbuffer *rb, void *data, size_t len)
+{
+    size_t read_pos = atomic_load_explicit(&rb->read_pos, memory_order_relaxed);
+    size_t write_pos = atomic_load_explicit(&rb->write_pos, memory_order_acquire);
+    size_t available = write_pos - read_pos;
+    if (len > available)
+        len = available;
+
+    size_t offset = read_pos & (rb->size - 1);
+    size_t first = rb->size - offset;
+    if (first > len)
+        first = len;
+    memcpy(data, rb->data + offset, first);
+    memcpy((uint8_t *) data + first, rb->data, len - first);
+
+    atomic_store_explicit(&rb->read_pos, read_pos + len, memory_order_release);
+    return len;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2020 Bryan Cain
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Lock-free ring buffer for one producer thread and one consumer thread.
+struct ringbuffer {
+    uint8_t *data;
+    size_t size; // always a power of two
+    atomic_size_t write_pos;
+    atomic_size_t read_pos;
+};
+
+// size is rounded up to a power of two
+void ringbuffer_init(struct ringbuffer *rb, size_t size);
+void ringbuffer_free(struct ringbuffer *rb);
+
+// Returns the number of bytes waiting to be read.
+size_t ringbuffer_used(struct ringbuffer *rb);
+
+// Writes as much of the data as fits. Returns the number of bytes written.
+// Only call this from the producer thread.
+size_t ringbuffer_write(struct ringbuffer *rb, const void *data, size_t len);
+
+// Reads up to len bytes. Returns the number of bytes read.
+// Only call this from the consumer thread.
+size_t ringbuffer_read(struct ringbuffer *rb, void *data, size_t len);
+
+#endif
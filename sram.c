@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2020 Bryan Cain
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include "sram.h"
+
+// If a game keeps writing to save RAM, flush anyway after this many delays.
+#define MAX_DELAYS 5
+
+static struct {
+    char *path;
+    size_t size;
+    gint64 flush_delay; // in microseconds
+
+    // The emulator thread's copy of save RAM as of the last check. Only the
+    // emulator thread uses this, so it can compare against it without locking.
+    uint8_t *shadow;
+
+    // The latest changes, waiting to be written out. Protected by lock.
+    uint8_t *pending;
+
+    // The copy being written out. Only the flush thread uses this; it's swapped
+    // with pending so that the file I/O happens without the lock.
+    uint8_t *writing;
+
+    // The save file, mapped on the first flush if it didn't exist yet.
+    int fd;
+    uint8_t *map;
+
+    GThread *thread;
+    GMutex lock;
+    GCond cond;
+    bool dirty;
+    bool quit;
+    gint64 first_change;
+    gint64 last_change;
+} g_sram = { .fd = -1 };
+
+// Opens and maps the save file, growing it to the size of save RAM if needed.
+// Returns the file's original size, or -1 on failure.
+static off_t map_file(bool create)
+{
+    int fd = open(g_sram.path, create ? (O_RDWR | O_CREAT) : O_RDWR, 0644);
+    if (fd < 0)
+        return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (st.st_size < (off_t) g_sram.size && ftruncate(fd, g_sram.size) != 0))
+    {
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, g_sram.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        close(fd);
+        return -1;
+    }
+
+    g_sram.fd = fd;
+    g_sram.map = map;
+    return st.st_size;
+}
+
+// Called with the lock held. The lock is released while the file is written,
+// since the emulator thread takes it whenever the game writes to save RAM.
+static void flush(void)
+{
+    uint8_t *data = g_sram.pending;
+    g_sram.pending = g_sram.writing;
+    g_sram.writing = data;
+    g_sram.dirty = false;
+    g_mutex_unlock(&g_sram.lock);
+
+    bool success = false;
+    if (!g_sram.map && map_file(true) < 0)
+    {
+        printf("Failed to open %s for saving SRAM\n", g_sram.path);
+    }
+    else
+    {
+        memcpy(g_sram.map, data, g_sram.size);
+        success = msync(g_sram.map, g_sram.size, MS_SYNC) == 0;
+        if (success)
+            printf("Saved SRAM to %s\n", g_sram.path);
+        else
+            printf("Failed to save SRAM to %s\n", g_sram.path);
+    }
+
+    g_mutex_lock(&g_sram.lock);
+}
+
+static gpointer flush_thread(gpointer unused)
+{
+    g_mutex_lock(&g_sram.lock);
+    while (!g_sram.quit)
+    {
+        if (!g_sram.dirty)
+        {
+            g_cond_wait(&g_sram.cond, &g_sram.lock);
+            continue;
+        }
+
+        // Wait until the game has stopped writing for a while.
+        gint64 deadline = MIN(g_sram.last_change + g_sram.flush_delay,
+                              g_sram.first_change + g_sram.flush_delay * MAX_DELAYS);
+        if (g_get_monotonic_time() < deadline)
+            g_cond_wait_until(&g_sram.cond, &g_sram.lock, deadline);
+        else
+            flush();
+    }
+
+    if (g_sram.dirty)
+        flush();
+    g_mutex_unlock(&g_sram.lock);
+    return NULL;
+}
+
+bool sram_open(const char *path, void *sram, size_t size, unsigned flush_delay_ms)
+{
+    if (!sram || !size)
+        return false;
+
+    g_sram.path = strdup(path);
+    g_sram.size = size;
+    g_sram.flush_delay = (gint64) flush_delay_ms * 1000;
+    g_sram.dirty = false;
+    g_sram.quit = false;
+
+    // Don't create the file until the game actually saves something.
+    off_t file_size = map_file(false);
+    bool loaded = file_size > 0;
+    if (loaded)
+        memcpy(sram, g_sram.map, MIN((size_t) file_size, size));
+
+    g_sram.shadow = malloc(size);
+    g_sram.pending = malloc(size);
+    g_sram.writing = malloc(size);
+    memcpy(g_sram.shadow, sram, size);
+
+    g_sram.thread = g_thread_new("SRAM flush", flush_thread, NULL);
+    return loaded;
+}
+
+void sram_check(const void *sram)
+{
+    if (!g_sram.shadow || memcmp(g_sram.shadow, sram, g_sram.size) == 0)
+        return;
+
+    memcpy(g_sram.shadow, sram, g_sram.size);
+
+    gint64 now = g_get_monotonic_time();
+    g_mutex_lock(&g_sram.lock);
+    memcpy(g_sram.pending, sram, g_sram.size);
+    if (!g_sram.dirty)
+        g_sram.first_change = now;
+    g_sram.last_change = now;
+    g_sram.dirty = true;
+    g_cond_signal(&g_sram.cond);
+    g_mutex_unlock(&g_sram.lock);
+}
+
+void sram_mark_saved(const void *sram)
+{
+    // Changes made before this point are still written out.
+    if (g_sram.shadow)
+        memcpy(g_sram.shadow, sram, g_sram.size);
+}
+
+void sram_close(void)
+{
+    if (!g_sram.shadow)
+        return;
+
+    g_mutex_lock(&g_sram.lock);
+    g_sram.quit = true;
+    g_cond_signal(&g_sram.cond);
+    g_mutex_unlock(&g_sram.lock);
+    g_thread_join(g_sram.thread);
+
+    if (g_sram.map)
+        munmap(g_sram.map, g_sram.size);
+    if (g_sram.fd >= 0)
+        close(g_sram.fd);
+    free(g_sram.shadow);
+    free(g_sram.pending);
+    free(g_sram.writing);
+    free(g_sram.path);
+
+    g_sram.thread = NULL;
+    g_sram.shadow = NULL;
+    g_sram.pending = NULL;
+    g_sram.writing = NULL;
+    g_sram.path = NULL;
+    g_sram.map = NULL;
+    g_sram.fd = -1;
+    g_sram.size = 0;
+}
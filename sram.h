@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2020 Bryan Cain
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SRAM_H
+#define SRAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Keeps the core's save RAM in sync with a memory-mapped .sav file. Changes are
+// picked up once per frame and written out by a background thread once the game
+// has stopped writing for flush_delay_ms, so games that write to save RAM
+// constantly don't cause any disk I/O on the emulator thread.
+
+// Copies the contents of the save file at path (if it exists) into sram, and
+// starts watching sram for changes. Returns true if save data was loaded.
+bool sram_open(const char *path, void *sram, size_t size, unsigned flush_delay_ms);
+
+// Checks sram for changes. Call once per frame from the emulator thread.
+void sram_check(const void *sram);
+
+// Takes the current contents of sram as already saved, so that loading a state
+// or rewinding doesn't overwrite the save file with older data.
+void sram_mark_saved(const void *sram);
+
+// Writes out any pending changes and closes the save file.
+void sram_close(void);
+
+#endif
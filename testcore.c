@@ -0,0 +1,490 @@
+/*
+ * Copyright (c) 2020 Bryan Cain
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Synthetic libretro core for testing and benchmarking the frontend without a
+// real emulator. Its output depends only on its settings, the frame number and
+// the input, so runs are reproducible on any machine. Any file can be loaded as
+// the game. bench sets it up for its core benchmarks and --check-handoff, and
+// headless runs it like any other core, e.g. with --realtime to check pacing
+// under TESTCORE_CPU_LOAD_US. Settings are read from environment variables
+// when the game is loaded:
+//
+//   TESTCORE_RESOLUTIONS     frame sizes to cycle through (default: 256x240)
+//                            e.g. 256x240,352x240,512x240
+//   TESTCORE_RESIZE_INTERVAL frames between resolution changes (default: 60)
+//   TESTCORE_FPS             frame rate (default: 59.82)
+//   TESTCORE_SAMPLE_RATE     audio sample rate (default: 44100)
+//   TESTCORE_AUDIO           "batch" for one audio_sample_batch call per frame,
+//                            "sample" for an audio_sample call per sample,
+//                            or "none" (default: batch)
+//   TESTCORE_STATE_SIZE      save state size in bytes (default: 262144)
+//   TESTCORE_CPU_LOAD_US     microseconds of busy work per frame (default: 0)
+//   TESTCORE_SRAM_SIZE       save RAM size in bytes (default: 2048)
+//   TESTCORE_SRAM_INTERVAL   frames between save RAM writes, 0 = never (default: 0)
+//   TESTCORE_SOFTWARE_FB     1 to render into GET_CURRENT_SOFTWARE_FRAMEBUFFER
+//                            when the frontend provides one (default: 0)
+//
+// build: gcc -O2 -shared -fPIC -o testcore.so testcore.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include "libretro.h"
+
+#define MAX_RESOLUTIONS 8
+
+static retro_environment_t environ_cb;
+static retro_video_refresh_t video_cb;
+static retro_input_poll_t input_poll_cb;
+static retro_input_state_t input_state_cb;
+static retro_audio_sample_t audio_sample_cb;
+static retro_audio_sample_batch_t audio_batch_cb;
+
+enum audio_mode {
+    AUDIO_BATCH,
+    AUDIO_SAMPLE,
+    AUDIO_NONE,
+};
+
+static struct {
+    unsigned widths[MAX_RESOLUTIONS];
+    unsigned heights[MAX_RESOLUTIONS];
+    unsigned num_resolutions;
+    unsigned resize_interval;
+    double fps;
+    double sample_rate;
+    enum audio_mode audio;
+    size_t state_size;
+    unsigned cpu_load_us;
+    size_t sram_size;
+    unsigned sram_interval;
+    bool software_fb;
+} g_settings;
+
+// Everything that's saved in a state. The rest of the state is filled with
+// "work RAM", a few bytes of which change every frame, like a real console's.
+struct core_state {
+    uint64_t frame;
+    uint32_t rng;
+    int32_t x, y;          // position of the square moved with the D-pad
+    uint32_t audio_phase;
+    double audio_remainder; // fraction of an audio frame carried over to the next video frame
+};
+
+static struct core_state g_state;
+static uint8_t *g_work_ram = NULL;
+static size_t g_work_ram_size = 0;
+static uint8_t *g_sram = NULL;
+static uint16_t *g_framebuffer = NULL;
+static int16_t *g_audio = NULL;
+static size_t g_audio_capacity = 0;
+
+static unsigned env_unsigned(const char *name, unsigned fallback)
+{
+    const char *value = getenv(name);
+    return value && *value ? (unsigned) strtoul(value, NULL, 0) : fallback;
+}
+
+static double env_double(const char *name, double fallback)
+{
+    const char *value = getenv(name);
+    return value && *value ? strtod(value, NULL) : fallback;
+}
+
+static void read_settings(void)
+{
+    const char *resolutions = getenv("TESTCORE_RESOLUTIONS");
+    if (!resolutions || !*resolutions)
+        resolutions = "256x240";
+
+    g_settings.num_resolutions = 0;
+    const char *p = resolutions;
+    while (*p && g_settings.num_resolutions < MAX_RESOLUTIONS)
+    {
+        unsigned w, h;
+        if (sscanf(p, "%ux%u", &w, &h) == 2 && w && h)
+        {
+            g_settings.widths[g_settings.num_resolutions] = w;
+            g_settings.heights[g_settings.num_resolutions] = h;
+            g_settings.num_resolutions++;
+        }
+        p = strchr(p, ',');
+        if (!p)
+            break;
+        p++;
+    }
+    if (!g_settings.num_resolutions)
+    {
+        g_settings.widths[0] = 256;
+        g_settings.heights[0] = 240;
+        g_settings.num_resolutions = 1;
+    }
+
+    g_settings.resize_interval = env_unsigned("TESTCORE_RESIZE_INTERVAL", 60);
+    g_settings.fps = env_double("TESTCORE_FPS", 59.82);
+    g_settings.sample_rate = env_double("TESTCORE_SAMPLE_RATE", 44100);
+
+    const char *audio = getenv("TESTCORE_AUDIO");
+    if (audio && strcmp(audio, "sample") == 0)
+        g_settings.audio = AUDIO_SAMPLE;
+    else if (audio && strcmp(audio, "none") == 0)
+        g_settings.audio = AUDIO_NONE;
+    else
+        g_settings.audio = AUDIO_BATCH;
+
+    g_settings.state_size = env_unsigned("TESTCORE_STATE_SIZE", 262144);
+    if (g_settings.state_size < sizeof(struct core_state))
+        g_settings.state_size = sizeof(struct core_state);
+    g_settings.cpu_load_us = env_unsigned("TESTCORE_CPU_LOAD_US", 0);
+    g_settings.sram_size = env_unsigned("TESTCORE_SRAM_SIZE", 2048);
+    g_settings.sram_interval = env_unsigned("TESTCORE_SRAM_INTERVAL", 0);
+    g_settings.software_fb = env_unsigned("TESTCORE_SOFTWARE_FB", 0) != 0;
+}
+
+static uint32_t next_random(void)
+{
+    // xorshift32
+    uint32_t x = g_state.rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    g_state.rng = x;
+    return x;
+}
+
+static void reset_state(void)
+{
+    memset(&g_state, 0, sizeof(g_state));
+    g_state.rng = 0x12345678;
+    g_state.x = 64;
+    g_state.y = 64;
+    for (size_t i = 0; i < g_work_ram_size; i++)
+        g_work_ram[i] = (uint8_t) (i * 7);
+}
+
+static void burn_cpu(unsigned microseconds)
+{
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000 < microseconds);
+}
+
+static void update_input(void)
+{
+    input_poll_cb();
+    if (input_state_cb(0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_LEFT))
+        g_state.x -= 2;
+    if (input_state_cb(0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_RIGHT))
+        g_state.x += 2;
+    if (input_state_cb(0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_UP))
+        g_state.y -= 2;
+    if (input_state_cb(0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_DOWN))
+        g_state.y += 2;
+}
+
+static void render(uint16_t *pixels, unsigned width, unsigned height, size_t pitch)
+{
+    unsigned frame = (unsigned) g_state.frame;
+    int sx = ((g_state.x % (int) width) + width) % width;
+    int sy = ((g_state.y % (int) height) + height) % height;
+
+    for (unsigned y = 0; y < height; y++)
+    {
+        uint16_t *row = (uint16_t *) ((uint8_t *) pixels + y * pitch);
+        for (unsigned x = 0; x < width; x++)
+        {
+            // Scrolling RGB565 gradient.
+            unsigned r = (x + frame) & 0x1f;
+            unsigned g = (y + frame / 2) & 0x3f;
+            unsigned b = ((x ^ y) >> 3) & 0x1f;
+            row[x] = (uint16_t) ((r << 11) | (g << 5) | b);
+        }
+    }
+
+    // A white square that follows the input.
+    for (unsigned y = sy; y < height && y < (unsigned) sy + 16; y++)
+    {
+        uint16_t *row = (uint16_t *) ((uint8_t *) pixels + y * pitch);
+        for (unsigned x = sx; x < width && x < (unsigned) sx + 16; x++)
+            row[x] = 0xffff;
+    }
+}
+
+static void output_video(void)
+{
+    unsigned index = g_settings.resize_interval ?
+        (unsigned) (g_state.frame / g_settings.resize_interval) % g_settings.num_resolutions : 0;
+    unsigned width = g_settings.widths[index];
+    unsigned height = g_settings.heights[index];
+
+    if (g_settings.software_fb)
+    {
+        struct retro_framebuffer fb = {0};
+        fb.width = width;
+        fb.height = height;
+        fb.access_flags = RETRO_MEMORY_ACCESS_WRITE;
+        if (environ_cb(RETRO_ENVIRONMENT_GET_CURRENT_SOFTWARE_FRAMEBUFFER, &fb) &&
+            fb.format == RETRO_PIXEL_FORMAT_RGB565)
+        {
+            render(fb.data, width, height, fb.pitch);
+            video_cb(fb.data, width, height, fb.pitch);
+            return;
+        }
+    }
+
+    render(g_framebuffer, width, height, width * 2);
+    video_cb(g_framebuffer, width, height, width * 2);
+}
+
+// The samples are generated even when the frontend doesn't want them, like a
+// real sound chip would keep running, so that the state doesn't depend on it.
+static void output_audio(bool enabled)
+{
+    double exact = g_settings.sample_rate / g_settings.fps + g_state.audio_remainder;
+    size_t frames = (size_t) exact;
+    g_state.audio_remainder = exact - frames;
+
+    if (frames > g_audio_capacity)
+    {
+        g_audio = realloc(g_audio, frames * 2 * sizeof(int16_t));
+        g_audio_capacity = frames;
+    }
+
+    // Triangle wave around 440 Hz at 44.1 kHz, computed with integers only.
+    for (size_t i = 0; i < frames; i++)
+    {
+        uint32_t phase = (g_state.audio_phase += 41) & 0xfff;
+        int16_t sample = (int16_t) ((phase < 0x800 ? phase : 0xfff - phase) * 8 - 8192);
+        g_audio[i * 2] = sample;
+        g_audio[i * 2 + 1] = -sample;
+    }
+
+    if (!enabled)
+        return;
+    if (g_settings.audio == AUDIO_BATCH)
+    {
+        size_t done = 0;
+        while (done < frames)
+            done += audio_batch_cb(g_audio + done * 2, frames - done);
+    }
+    else
+    {
+        for (size_t i = 0; i < frames; i++)
+            audio_sample_cb(g_audio[i * 2], g_audio[i * 2 + 1]);
+    }
+}
+
+void retro_set_environment(retro_environment_t cb)
+{
+    environ_cb = cb;
+}
+
+void retro_set_video_refresh(retro_video_refresh_t cb)
+{
+    video_cb = cb;
+}
+
+void retro_set_audio_sample(retro_audio_sample_t cb)
+{
+    audio_sample_cb = cb;
+}
+
+void retro_set_audio_sample_batch(retro_audio_sample_batch_t cb)
+{
+    audio_batch_cb = cb;
+}
+
+void retro_set_input_poll(retro_input_poll_t cb)
+{
+    input_poll_cb = cb;
+}
+
+void retro_set_input_state(retro_input_state_t cb)
+{
+    input_state_cb = cb;
+}
+
+void retro_init(void)
+{
+}
+
+void retro_deinit(void)
+{
+}
+
+unsigned retro_api_version(void)
+{
+    return RETRO_API_VERSION;
+}
+
+void retro_get_system_info(struct retro_system_info *info)
+{
+    memset(info, 0, sizeof(*info));
+    info->library_name = "testcore";
+    info->library_version = "1";
+    info->need_fullpath = false;
+    info->block_extract = false;
+}
+
+void retro_get_system_av_info(struct retro_system_av_info *info)
+{
+    memset(info, 0, sizeof(*info));
+    for (unsigned i = 0; i < g_settings.num_resolutions; i++)
+    {
+        if (g_settings.widths[i] > info->geometry.max_width)
+            info->geometry.max_width = g_settings.widths[i];
+        if (g_settings.heights[i] > info->geometry.max_height)
+            info->geometry.max_height = g_settings.heights[i];
+    }
+    info->geometry.base_width = g_settings.widths[0];
+    info->geometry.base_height = g_settings.heights[0];
+    info->geometry.aspect_ratio = 4.0f / 3.0f;
+    info->timing.fps = g_settings.fps;
+    info->timing.sample_rate = g_settings.sample_rate;
+}
+
+void retro_set_controller_port_device(unsigned port, unsigned device)
+{
+}
+
+void retro_reset(void)
+{
+    reset_state();
+}
+
+void retro_run(void)
+{
+    int av_enable = 3;
+    if (!environ_cb(RETRO_ENVIRONMENT_GET_AUDIO_VIDEO_ENABLE, &av_enable))
+        av_enable = 3;
+
+    update_input();
+
+    // Emulate: a few bytes of work RAM change every frame.
+    for (int i = 0; i < 16 && g_work_ram_size; i++)
+        g_work_ram[next_random() % g_work_ram_size] = (uint8_t) next_random();
+    if (g_settings.cpu_load_us)
+        burn_cpu(g_settings.cpu_load_us);
+
+    if (g_settings.sram_interval && g_settings.sram_size && g_state.frame % g_settings.sram_interval == 0)
+        g_sram[(g_state.frame / g_settings.sram_interval) % g_settings.sram_size]++;
+
+    if (av_enable & 1)
+        output_video();
+    if (g_settings.audio != AUDIO_NONE)
+        output_audio(av_enable & 2);
+
+    g_state.frame++;
+}
+
+size_t retro_serialize_size(void)
+{
+    return g_settings.state_size;
+}
+
+bool retro_serialize(void *data, size_t size)
+{
+    if (size < g_settings.state_size)
+        return false;
+
+    memcpy(data, &g_state, sizeof(g_state));
+    memcpy((uint8_t *) data + sizeof(g_state), g_work_ram, g_work_ram_size);
+    return true;
+}
+
+bool retro_unserialize(const void *data, size_t size)
+{
+    if (size < g_settings.state_size)
+        return false;
+
+    memcpy(&g_state, data, sizeof(g_state));
+    memcpy(g_work_ram, (const uint8_t *) data + sizeof(g_state), g_work_ram_size);
+    return true;
+}
+
+void retro_cheat_reset(void)
+{
+}
+
+void retro_cheat_set(unsigned index, bool enabled, const char *code)
+{
+}
+
+bool retro_load_game(const struct retro_game_info *game)
+{
+    enum retro_pixel_format format = RETRO_PIXEL_FORMAT_RGB565;
+    if (!environ_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &format))
+        return false;
+
+    read_settings();
+
+    unsigned max_width = 0, max_height = 0;
+    for (unsigned i = 0; i < g_settings.num_resolutions; i++)
+    {
+        if (g_settings.widths[i] > max_width)
+            max_width = g_settings.widths[i];
+        if (g_settings.heights[i] > max_height)
+            max_height = g_settings.heights[i];
+    }
+
+    g_framebuffer = calloc((size_t) max_width * max_height, sizeof(uint16_t));
+    g_work_ram_size = g_settings.state_size - sizeof(struct core_state);
+    g_work_ram = malloc(g_work_ram_size ? g_work_ram_size : 1);
+    g_sram = calloc(g_settings.sram_size ? g_settings.sram_size : 1, 1);
+    reset_state();
+    return true;
+}
+
+bool retro_load_game_special(unsigned game_type, const struct retro_game_info *info, size_t num_info)
+{
+    return false;
+}
+
+void retro_unload_game(void)
+{
+    free(g_framebuffer);
+    free(g_work_ram);
+    free(g_sram);
+    free(g_audio);
+    g_framebuffer = NULL;
+    g_work_ram = NULL;
+    g_work_ram_size = 0;
+    g_sram = NULL;
+    g_audio = NULL;
+    g_audio_capacity = 0;
+}
+
+unsigned retro_get_region(void)
+{
+    return RETRO_REGION_NTSC;
+}
+
+void *retro_get_memory_data(unsigned id)
+{
+    return id == RETRO_MEMORY_SAVE_RAM && g_settings.sram_size ? g_sram : NULL;
+}
+
+size_t retro_get_memory_size(unsigned id)
+{
+    return id == RETRO_MEMORY_SAVE_RAM ? g_settings.sram_size : 0;
+}
@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2020 Bryan Cain
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include "texupload.h"
+
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+// Frames are streamed to the texture through a ring of pixel buffer objects,
+// so that glTexSubImage2D returns right away instead of waiting for the driver
+// to copy from client memory. With ARB_buffer_storage, the buffers stay mapped.
+#define NUM_PBOS 3
+static struct {
+    enum texupload_mode mode;
+    GLuint buffers[NUM_PBOS];
+    void *mapped[NUM_PBOS];
+    GLsync fences[NUM_PBOS];
+    size_t size;
+    int next;
+} g_pbo = {0};
+
+static bool has_gl_extension(int gl_version, const char *name)
+{
+    // glGetStringi is new in GL 3.0; before that, extensions come in one string.
+    if (gl_version < 30)
+    {
+        const char *list = (const char *) glGetString(GL_EXTENSIONS);
+        size_t length = strlen(name);
+        for (const char *p = list; p && (p = strstr(p, name)); p += length)
+        {
+            if ((p == list || p[-1] == ' ') && (p[length] == ' ' || p[length] == '\0'))
+                return true;
+        }
+        return false;
+    }
+
+    GLint count = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+    for (GLint i = 0; i < count; i++)
+    {
+        if (strcmp((const char *) glGetStringi(GL_EXTENSIONS, i), name) == 0)
+            return true;
+    }
+    return false;
+}
+
+enum texupload_mode texupload_detect_mode(int gl_version)
+{
+    // Both PBO modes map the buffers with glMapBufferRange (GL 3.0) and fence
+    // them with glFenceSync (GL 3.2), on top of the PBOs themselves (GL 2.1).
+    bool pbo = gl_version >= 32 ||
+        ((gl_version >= 21 || has_gl_extension(gl_version, "GL_ARB_pixel_buffer_object")) &&
+         (gl_version >= 30 || has_gl_extension(gl_version, "GL_ARB_map_buffer_range")) &&
+         has_gl_extension(gl_version, "GL_ARB_sync"));
+    if (!pbo)
+        return TEXUPLOAD_DIRECT;
+    if (gl_version >= 44 || has_gl_extension(gl_version, "GL_ARB_buffer_storage"))
+        return TEXUPLOAD_PERSISTENT;
+    return TEXUPLOAD_PBO;
+}
+
+const char *texupload_mode_name(enum texupload_mode mode)
+{
+    switch (mode)
+    {
+        case TEXUPLOAD_PBO: return "PBOs";
+        case TEXUPLOAD_PERSISTENT: return "persistent mapped PBOs";
+        default: return "direct";
+    }
+}
+
+void texupload_init(enum texupload_mode mode)
+{
+    texupload_free();
+    g_pbo.mode = mode;
+}
+
+// (Re)creates the pixel buffers with room for at least size bytes each.
+static void pbo_alloc(size_t size)
+{
+    texupload_free();
+
+    glGenBuffers(NUM_PBOS, g_pbo.buffers);
+    for (int i = 0; i < NUM_PBOS; i++)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, g_pbo.buffers[i]);
+        if (g_pbo.mode == TEXUPLOAD_PERSISTENT)
+        {
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, NULL, flags);
+            g_pbo.mapped[i] = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags);
+        }
+        else
+        {
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+        }
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    g_pbo.size = size;
+    g_pbo.next = 0;
+}
+
+void texupload_alloc(unsigned max_width, unsigned max_height)
+{
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, max_width, max_height, 0,
+                 GL_RGB, GL_UNSIGNED_SHORT_5_6_5, NULL);
+    if (g_pbo.mode != TEXUPLOAD_DIRECT)
+        pbo_alloc(max_width * max_height * 2);
+}
+
+void texupload_frame(unsigned width, unsigned height, const void *data)
+{
+    size_t size = width * height * 2;
+
+    if (g_pbo.mode == TEXUPLOAD_DIRECT)
+    {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height,
+            GL_RGB, GL_UNSIGNED_SHORT_5_6_5, data);
+        return;
+    }
+
+    if (size > g_pbo.size)
+        pbo_alloc(size);
+
+    // Don't write into a buffer that the GPU may still be reading from.
+    int i = g_pbo.next;
+    g_pbo.next = (i + 1) % NUM_PBOS;
+    if (g_pbo.fences[i])
+    {
+        glClientWaitSync(g_pbo.fences[i], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+        glDeleteSync(g_pbo.fences[i]);
+        g_pbo.fences[i] = NULL;
+    }
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, g_pbo.buffers[i]);
+    if (g_pbo.mode == TEXUPLOAD_PERSISTENT)
+    {
+        memcpy(g_pbo.mapped[i], data, size);
+    }
+    else
+    {
+        void *dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+        memcpy(dst, data, size);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    }
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height,
+        GL_RGB, GL_UNSIGNED_SHORT_5_6_5, NULL);
+    g_pbo.fences[i] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+void texupload_free(void)
+{
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    for (int i = 0; i < NUM_PBOS; i++)
+    {
+        if (g_pbo.fences[i])
+            glDeleteSync(g_pbo.fences[i]);
+        g_pbo.fences[i] = NULL;
+        g_pbo.mapped[i] = NULL;
+    }
+    if (g_pbo.buffers[0])
+        glDeleteBuffers(NUM_PBOS, g_pbo.buffers);
+    memset(g_pbo.buffers, 0, sizeof(g_pbo.buffers));
+    g_pbo.size = 0;
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2020 Bryan Cain
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef TEXUPLOAD_H
+#define TEXUPLOAD_H
+
+#include <stdbool.h>
+
+// Streams RGB565 frames into the currently bound GL_TEXTURE_2D. Needs a current
+// GL context; all functions must be called from the thread that owns it.
+
+enum texupload_mode {
+    TEXUPLOAD_DIRECT,     // glTexSubImage2D from client memory
+    TEXUPLOAD_PBO,        // through a ring of pixel buffer objects
+    TEXUPLOAD_PERSISTENT, // through persistently mapped pixel buffer objects
+};
+
+// Returns the fastest mode supported by the current context, given its GL
+// version as major * 10 + minor.
+enum texupload_mode texupload_detect_mode(int gl_version);
+
+const char *texupload_mode_name(enum texupload_mode mode);
+
+void texupload_init(enum texupload_mode mode);
+
+// (Re)allocates the texture and any pixel buffers for frames up to this size.
+void texupload_alloc(unsigned max_width, unsigned max_height);
+
+// Uploads a tightly packed frame to the top left corner of the texture.
+void texupload_frame(unsigned width, unsigned height, const void *data);
+
+// Frees the pixel buffers. The texture itself belongs to the caller.
+void texupload_free(void);
+
+#endif
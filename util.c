@@ -17,6 +17,20 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include "util.h"
+
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t hash_round(uint64_t lane, uint64_t word)
+{
+    return rotl64(lane + word * HASH_PRIME2, 31) * HASH_PRIME1;
+}
 
 // returns a newly allocated string; it's the caller's responsibility to free it
 // example: string_replace_extension("/path/to/gamename.pce", ".sav") -> "/path/to/gamename.sav"
@@ -41,3 +55,56 @@ char * string_replace_extension(const char *original, const char *extension)
     return result;
 }
 
+
+void copy_rows(void *dst, size_t dst_pitch, const void *src, size_t src_pitch,
+               size_t row_size, unsigned rows)
+{
+    if (dst_pitch == row_size && src_pitch == row_size)
+    {
+        memcpy(dst, src, row_size * rows);
+        return;
+    }
+
+    const uint8_t *s = (const uint8_t *) src;
+    uint8_t *d = (uint8_t *) dst;
+    for (unsigned y = 0; y < rows; y++)
+    {
+        memcpy(d, s, row_size);
+        s += src_pitch;
+        d += dst_pitch;
+    }
+}
+
+// Hashes four independent 64-bit lanes at a time, so that the multiplies overlap
+// instead of each one waiting for the last.
+uint64_t hash_buffer(const void *data, size_t size)
+{
+    const uint8_t *p = (const uint8_t *) data;
+    uint64_t lanes[4] = { HASH_PRIME1 + HASH_PRIME2, HASH_PRIME2, 0, -HASH_PRIME1 };
+    uint64_t h = size;
+    uint64_t word;
+
+    for (; size >= 32; p += 32, size -= 32)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            memcpy(&word, p + i * 8, 8);
+            lanes[i] = hash_round(lanes[i], word);
+        }
+    }
+    for (int i = 0; i < 4; i++)
+        h = hash_round(h, lanes[i]);
+
+    for (; size >= 8; p += 8, size -= 8)
+    {
+        memcpy(&word, p, 8);
+        h = hash_round(h, word);
+    }
+    for (; size > 0; p++, size--)
+        h = (h ^ *p) * HASH_PRIME1;
+
+    h ^= h >> 33;
+    h *= HASH_PRIME2;
+    h ^= h >> 29;
+    return h;
+}
@@ -18,9 +18,20 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 // returns a newly allocated string; it's the caller's responsibility to free it
 // example: string_replace_extension("/path/to/gamename.pce", ".sav") -> "/path/to/gamename.sav"
 char * string_replace_extension(const char *original, const char *extension);
 
+// Copies rows of row_size bytes between images with the given pitches. When
+// neither image has padding between rows, it's done as a single memcpy.
+void copy_rows(void *dst, size_t dst_pitch, const void *src, size_t src_pitch,
+               size_t row_size, unsigned rows);
+
+// fast non-cryptographic hash, for telling whether a buffer has changed
+uint64_t hash_buffer(const void *data, size_t size);
+
 #endif
 
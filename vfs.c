@@ -0,0 +1,449 @@
+/*
+ * Copyright (c) 2020 Bryan Cain
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include "vfs.h"
+
+// How far ahead of the current read position to keep mapped files in memory.
+#define READ_AHEAD_SIZE (2 << 20)
+#define PAGE_SIZE 4096
+
+// A read-only file's contents, shared with the read-ahead thread.
+struct mapping {
+    atomic_int refs;
+    uint8_t *data;
+    size_t size;
+    bool preloaded; // data is a heap copy instead of a mapping
+};
+
+struct retro_vfs_file_handle {
+    char *path;
+    int fd;
+    int64_t pos;
+
+    // For read-only files; NULL if the file couldn't be mapped.
+    struct mapping *mapping;
+    int64_t read_ahead_start, read_ahead_end;
+
+    // Read latency, for finding stalls.
+    uint64_t reads;
+    uint64_t bytes_read;
+    gint64 read_time;
+    gint64 max_read_time;
+};
+
+struct retro_vfs_dir_handle {
+    char *path;
+    GDir *dir;
+    const char *name;
+};
+
+struct read_ahead_request {
+    struct mapping *mapping;
+    size_t offset;
+    size_t size;
+};
+
+static bool g_preload = false;
+static GThread *g_read_ahead_thread = NULL;
+static GAsyncQueue *g_read_ahead_requests = NULL;
+static atomic_llong g_max_read_time = 0; // in microseconds
+static atomic_ullong g_total_bytes_read = 0;
+
+static void mapping_unref(struct mapping *mapping)
+{
+    if (atomic_fetch_sub(&mapping->refs, 1) != 1)
+        return;
+
+    if (mapping->preloaded)
+        free(mapping->data);
+    else
+        munmap(mapping->data, mapping->size);
+    free(mapping);
+}
+
+static gpointer read_ahead_thread(gpointer unused)
+{
+    while (true)
+    {
+        struct read_ahead_request *request = g_async_queue_pop(g_read_ahead_requests);
+        uint8_t *start = request->mapping->data + request->offset;
+
+        // Ask the kernel to start reading, then touch every page so that they're
+        // all in memory by the time the emulator thread gets there.
+        uintptr_t aligned = (uintptr_t) start & ~(uintptr_t) (PAGE_SIZE - 1);
+        madvise((void *) aligned, request->size + ((uintptr_t) start - aligned), MADV_WILLNEED);
+        for (size_t i = 0; i < request->size; i += PAGE_SIZE)
+            (void) *(volatile uint8_t *) (start + i);
+
+        mapping_unref(request->mapping);
+        free(request);
+    }
+
+    return NULL;
+}
+
+// Makes sure the data after the current position is being read ahead.
+static void read_ahead(struct retro_vfs_file_handle *stream)
+{
+    struct mapping *mapping = stream->mapping;
+    if (mapping->preloaded || stream->pos >= (int64_t) mapping->size)
+        return;
+
+    // Sequential reads only need a new request once they're halfway through the
+    // last one; a seek anywhere else starts over.
+    if (stream->pos >= stream->read_ahead_start && stream->pos < stream->read_ahead_end - READ_AHEAD_SIZE / 2)
+        return;
+
+    int64_t start = stream->pos;
+    if (start >= stream->read_ahead_start && start < stream->read_ahead_end)
+        start = stream->read_ahead_end;
+    int64_t end = MIN(stream->pos + READ_AHEAD_SIZE, (int64_t) mapping->size);
+    stream->read_ahead_start = stream->pos;
+    stream->read_ahead_end = end;
+    if (start >= end)
+        return;
+
+    struct read_ahead_request *request = malloc(sizeof(*request));
+    atomic_fetch_add(&mapping->refs, 1);
+    request->mapping = mapping;
+    request->offset = start;
+    request->size = end - start;
+    g_async_queue_push(g_read_ahead_requests, request);
+}
+
+static struct mapping *map_file(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+        return NULL;
+
+    struct mapping *mapping = calloc(1, sizeof(*mapping));
+    atomic_init(&mapping->refs, 1);
+    mapping->size = st.st_size;
+
+    if (g_preload)
+    {
+        mapping->data = malloc(mapping->size);
+        mapping->preloaded = true;
+        size_t done = 0;
+        while (mapping->data && done < mapping->size)
+        {
+            ssize_t n = pread(fd, mapping->data + done, mapping->size - done, done);
+            if (n <= 0)
+                break;
+            done += n;
+        }
+
+        if (done == mapping->size)
+            return mapping;
+    }
+    else
+    {
+        mapping->data = mmap(NULL, mapping->size, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapping->data != MAP_FAILED)
+            return mapping;
+        mapping->data = NULL;
+    }
+
+    free(mapping->data);
+    free(mapping);
+    return NULL;
+}
+
+static const char *vfs_get_path(struct retro_vfs_file_handle *stream)
+{
+    return stream->path;
+}
+
+static struct retro_vfs_file_handle *vfs_open(const char *path, unsigned mode, unsigned hints)
+{
+    int flags;
+    if (mode == RETRO_VFS_FILE_ACCESS_READ)
+        flags = O_RDONLY;
+    else
+    {
+        flags = (mode & RETRO_VFS_FILE_ACCESS_READ) ? O_RDWR : O_WRONLY;
+        flags |= O_CREAT;
+        if (!(mode & RETRO_VFS_FILE_ACCESS_UPDATE_EXISTING))
+            flags |= O_TRUNC;
+    }
+
+    int fd = open(path, flags, 0644);
+    if (fd < 0)
+        return NULL;
+
+    struct retro_vfs_file_handle *stream = calloc(1, sizeof(*stream));
+    stream->path = strdup(path);
+    stream->fd = fd;
+
+    if (mode == RETRO_VFS_FILE_ACCESS_READ)
+    {
+        stream->mapping = map_file(fd);
+        if (stream->mapping)
+        {
+            if (stream->mapping->preloaded)
+                printf("Loaded %s into memory (%zu bytes)\n", path, stream->mapping->size);
+            read_ahead(stream);
+        }
+    }
+
+    return stream;
+}
+
+static int vfs_close(struct retro_vfs_file_handle *stream)
+{
+    if (stream->reads)
+    {
+        printf("VFS: %s: %llu reads, %llu bytes, mean %.1f us, max %.1f us\n", stream->path,
+               (unsigned long long) stream->reads, (unsigned long long) stream->bytes_read,
+               (double) stream->read_time / stream->reads, (double) stream->max_read_time);
+    }
+
+    if (stream->mapping)
+        mapping_unref(stream->mapping);
+    int result = close(stream->fd);
+    free(stream->path);
+    free(stream);
+    return result == 0 ? 0 : -1;
+}
+
+static int64_t vfs_size(struct retro_vfs_file_handle *stream)
+{
+    if (stream->mapping)
+        return stream->mapping->size;
+
+    struct stat st;
+    return fstat(stream->fd, &st) == 0 ? st.st_size : -1;
+}
+
+static int64_t vfs_truncate(struct retro_vfs_file_handle *stream, int64_t length)
+{
+    if (stream->mapping)
+        return -1;
+    return ftruncate(stream->fd, length) == 0 ? 0 : -1;
+}
+
+static int64_t vfs_tell(struct retro_vfs_file_handle *stream)
+{
+    return stream->pos;
+}
+
+static int64_t vfs_seek(struct retro_vfs_file_handle *stream, int64_t offset, int seek_position)
+{
+    int64_t base;
+    switch (seek_position)
+    {
+    case RETRO_VFS_SEEK_POSITION_START:
+        base = 0;
+        break;
+    case RETRO_VFS_SEEK_POSITION_CURRENT:
+        base = stream->pos;
+        break;
+    case RETRO_VFS_SEEK_POSITION_END:
+        base = vfs_size(stream);
+        break;
+    default:
+        return -1;
+    }
+
+    if (base < 0 || base + offset < 0)
+        return -1;
+    stream->pos = base + offset;
+    return stream->pos;
+}
+
+static int64_t vfs_read(struct retro_vfs_file_handle *stream, void *s, uint64_t len)
+{
+    gint64 start = g_get_monotonic_time();
+    int64_t result;
+
+    if (stream->mapping)
+    {
+        int64_t size = stream->mapping->size;
+        result = stream->pos < size ? MIN((int64_t) len, size - stream->pos) : 0;
+        if (result > 0)
+            memcpy(s, stream->mapping->data + stream->pos, result);
+        stream->pos += result;
+        read_ahead(stream);
+    }
+    else
+    {
+        result = pread(stream->fd, s, len, stream->pos);
+        if (result > 0)
+            stream->pos += result;
+    }
+
+    gint64 elapsed = g_get_monotonic_time() - start;
+    stream->reads++;
+    stream->bytes_read += MAX(result, 0);
+    atomic_fetch_add(&g_total_bytes_read, MAX(result, 0));
+    stream->read_time += elapsed;
+    stream->max_read_time = MAX(stream->max_read_time, elapsed);
+
+    long long max = atomic_load(&g_max_read_time);
+    while (elapsed > max && !atomic_compare_exchange_weak(&g_max_read_time, &max, elapsed))
+        ;
+
+    return result;
+}
+
+static int64_t vfs_write(struct retro_vfs_file_handle *stream, const void *s, uint64_t len)
+{
+    if (stream->mapping)
+        return -1;
+
+    int64_t result = pwrite(stream->fd, s, len, stream->pos);
+    if (result > 0)
+        stream->pos += result;
+    return result;
+}
+
+static int vfs_flush(struct retro_vfs_file_handle *stream)
+{
+    // Writes go straight to the file descriptor, so there's nothing buffered.
+    return 0;
+}
+
+static int vfs_remove(const char *path)
+{
+    return remove(path) == 0 ? 0 : -1;
+}
+
+static int vfs_rename(const char *old_path, const char *new_path)
+{
+    return rename(old_path, new_path) == 0 ? 0 : -1;
+}
+
+static int vfs_stat(const char *path, int32_t *size)
+{
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return 0;
+
+    if (size)
+        *size = (int32_t) st.st_size;
+
+    int flags = RETRO_VFS_STAT_IS_VALID;
+    if (S_ISDIR(st.st_mode))
+        flags |= RETRO_VFS_STAT_IS_DIRECTORY;
+    if (S_ISCHR(st.st_mode))
+        flags |= RETRO_VFS_STAT_IS_CHARACTER_SPECIAL;
+    return flags;
+}
+
+static int vfs_mkdir(const char *dir)
+{
+    if (g_file_test(dir, G_FILE_TEST_IS_DIR))
+        return -2;
+    return mkdir(dir, 0755) == 0 ? 0 : -1;
+}
+
+static struct retro_vfs_dir_handle *vfs_opendir(const char *dir, bool include_hidden)
+{
+    GDir *gdir = g_dir_open(dir, 0, NULL);
+    if (!gdir)
+        return NULL;
+
+    struct retro_vfs_dir_handle *dirstream = calloc(1, sizeof(*dirstream));
+    dirstream->path = strdup(dir);
+    dirstream->dir = gdir;
+    return dirstream;
+}
+
+static bool vfs_readdir(struct retro_vfs_dir_handle *dirstream)
+{
+    dirstream->name = g_dir_read_name(dirstream->dir);
+    return dirstream->name != NULL;
+}
+
+static const char *vfs_dirent_get_name(struct retro_vfs_dir_handle *dirstream)
+{
+    return dirstream->name;
+}
+
+static bool vfs_dirent_is_dir(struct retro_vfs_dir_handle *dirstream)
+{
+    char *path = g_build_filename(dirstream->path, dirstream->name, NULL);
+    bool is_dir = g_file_test(path, G_FILE_TEST_IS_DIR);
+    g_free(path);
+    return is_dir;
+}
+
+static int vfs_closedir(struct retro_vfs_dir_handle *dirstream)
+{
+    g_dir_close(dirstream->dir);
+    free(dirstream->path);
+    free(dirstream);
+    return 0;
+}
+
+static struct retro_vfs_interface g_vfs_interface = {
+    vfs_get_path,
+    vfs_open,
+    vfs_close,
+    vfs_size,
+    vfs_tell,
+    vfs_seek,
+    vfs_read,
+    vfs_write,
+    vfs_flush,
+    vfs_remove,
+    vfs_rename,
+    vfs_truncate,
+    vfs_stat,
+    vfs_mkdir,
+    vfs_opendir,
+    vfs_readdir,
+    vfs_dirent_get_name,
+    vfs_dirent_is_dir,
+    vfs_closedir,
+};
+
+void vfs_init(bool preload)
+{
+    g_preload = preload;
+    if (g_read_ahead_thread)
+        return;
+
+    g_read_ahead_requests = g_async_queue_new();
+    g_read_ahead_thread = g_thread_new("VFS read-ahead", read_ahead_thread, NULL);
+}
+
+struct retro_vfs_interface *vfs_get_interface(void)
+{
+    return &g_vfs_interface;
+}
+
+uint64_t vfs_total_bytes_read(void)
+{
+    return atomic_load(&g_total_bytes_read);
+}
+
+double vfs_take_max_read_time(void)
+{
+    return atomic_exchange(&g_max_read_time, 0) / 1e6;
+}
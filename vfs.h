@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2020 Bryan Cain
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef VFS_H
+#define VFS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "libretro.h"
+
+// Implements the libretro VFS interface, so that the core's file access goes
+// through the frontend. Files opened read-only (disc images) are memory-mapped
+// and read ahead on a background thread, or optionally loaded into RAM in full,
+// so that CD seeks don't block the emulator thread on the disk.
+
+#define VFS_INTERFACE_VERSION 3
+
+// Starts the read-ahead thread if it isn't running yet. If preload is set,
+// read-only files are read into memory in full when they're opened.
+void vfs_init(bool preload);
+
+// Returns the interface to give the core for RETRO_ENVIRONMENT_GET_VFS_INTERFACE.
+struct retro_vfs_interface *vfs_get_interface(void);
+
+// Returns the total number of bytes the core has read through the VFS.
+uint64_t vfs_total_bytes_read(void);
+
+// Returns the longest time any single read took since the last call, in seconds.
+double vfs_take_max_read_time(void);
+
+#endif